@@ -0,0 +1,129 @@
+#ifndef LANG_ID_ARENA_H
+#define LANG_ID_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+
+// Forwards to upstream, counting the blocks asked for since the last clear.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(std::pmr::memory_resource *upstream) : upstream_(upstream) {}
+
+    int64_t allocNum() const {
+        return alloc_num_;
+    }
+
+    size_t allocBytes() const {
+        return alloc_bytes_;
+    }
+
+    void clear() {
+        alloc_num_ = 0;
+        alloc_bytes_ = 0;
+    }
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        ++alloc_num_;
+        alloc_bytes_ += bytes;
+        return upstream_->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource *upstream_;
+    int64_t alloc_num_ = 0;
+    size_t alloc_bytes_ = 0;
+};
+
+// Counts, over every Arena in the process, the requests served, the allocations made from arenas,
+// the blocks an arena had to take from the heap because it was full, and the times an arena grew.
+// Only what is allocated through an arena is counted: a request's other heap calls, such as the
+// words it adds to a word cache or the nodes of a graph, are not, so overflow_alloc_num staying put
+// does not mean a request made no heap call. bench_alloc counts those.
+struct ArenaStats {
+    std::atomic<int64_t> request_num = 0;
+    std::atomic<int64_t> alloc_num = 0;
+    std::atomic<int64_t> overflow_alloc_num = 0;
+    std::atomic<int64_t> grow_num = 0;
+};
+
+inline ArenaStats &arenaStats() {
+    static ArenaStats stats;
+    return stats;
+}
+
+// Memory for one request at a time, handed out by bumping a pointer through a buffer and taken
+// back all at once by reset. A request that outgrows the buffer gets the rest from the heap, and
+// the buffer is then enlarged to fit it, so once requests stop growing no heap call is made. An
+// Arena is used by one thread only.
+class Arena : public std::pmr::memory_resource {
+public:
+    explicit Arena(size_t capacity = 1 << 20) : heap_(std::pmr::new_delete_resource()) {
+        allocateBuffer(capacity);
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Frees everything allocated since the last reset. Nothing allocated from the arena may be used
+    // after it.
+    void reset() {
+        ArenaStats &stats = arenaStats();
+        ++stats.request_num;
+        stats.alloc_num += alloc_num_;
+        stats.overflow_alloc_num += heap_.allocNum();
+        size_t overflow = heap_.allocBytes();
+        alloc_num_ = 0;
+        heap_.clear();
+        if (overflow > 0) {
+            ++stats.grow_num;
+            allocateBuffer(capacity_ + overflow);
+        } else {
+            monotonic_->release();
+        }
+    }
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        ++alloc_num_;
+        return monotonic_->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        monotonic_->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    void allocateBuffer(size_t capacity) {
+        monotonic_.reset();
+        buffer_.reset(new std::byte[capacity]);
+        capacity_ = capacity;
+        monotonic_.emplace(buffer_.get(), capacity_, &heap_);
+    }
+
+    CountingResource heap_;
+    std::unique_ptr<std::byte[]> buffer_;
+    size_t capacity_ = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> monotonic_;
+    int64_t alloc_num_ = 0;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef LANG_ID_BATCH_SAMPLER_H
+#define LANG_ID_BATCH_SAMPLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+#include "dataset.h"
+#include "worker_pool.h"
+#include "model/model.h"
+
+// Maps a length to a bucket, exactly below 4 and then two buckets per power of two, so that the
+// lengths in a bucket differ by at most about 1.5x.
+inline int lengthBucket(int64_t len) {
+    if (len < 4) {
+        return len;
+    }
+    int bits = 64 - __builtin_clzll(len);
+    return bits * 2 + ((len >> (bits - 2)) & 1);
+}
+
+// Caps a batch by its segment count, by the estimated cost of its sents, or by both. A batch takes
+// sents while it is below every cap, so it always holds at least one.
+struct BatchBudget {
+    int max_seg_num = std::numeric_limits<int>::max();
+    double max_cost = std::numeric_limits<double>::infinity();
+};
+
+// Cuts a dataset into batches of sent indices. With bucketing, sents are grouped by segment count
+// and token length, each batch is drawn from one group, and the batches are then shuffled, so that
+// a graph does not mix very short and very long sents. Without it, the sents are shuffled as a
+// whole and cut in order, as main did before. Either way the batches depend only on the seed.
+class BatchSampler {
+public:
+    BatchSampler(const Dataset &dataset, int seg_len, int word_symbol_id, const EncoderCost &cost,
+            bool bucketed,
+            int thread_num = 1) : bucketed_(bucketed), seg_nums_(dataset.size()),
+        costs_(dataset.size()) {
+        constexpr int CHUNK_SIZE = 1 << 14;
+        int chunk_num = (dataset.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        parallelFor(chunk_num, thread_num, [&](int chunk_i) {
+            size_t end = std::min<size_t>((chunk_i + 1) * CHUNK_SIZE, dataset.size());
+            for (size_t i = chunk_i * CHUNK_SIZE; i < end; ++i) {
+                seg_nums_.at(i) = segmentCount(dataset.sent(i), seg_len, word_symbol_id);
+                costs_.at(i) = cost.sentCost(dataset.sent(i), seg_len, word_symbol_id);
+            }
+        });
+
+        if (!bucketed_) {
+            buckets_.resize(1);
+            for (int i = 0; i < dataset.size(); ++i) {
+                buckets_.front().push_back(i);
+            }
+            return;
+        }
+        // An ordered map, so that the buckets come out in the same order on every run.
+        std::map<std::pair<int, int>, std::vector<int>> bucket_map;
+        for (int i = 0; i < dataset.size(); ++i) {
+            auto key = std::make_pair(lengthBucket(seg_nums_.at(i)),
+                    lengthBucket(dataset.sent(i).size()));
+            bucket_map[key].push_back(i);
+        }
+        for (auto &it : bucket_map) {
+            buckets_.push_back(std::move(it.second));
+        }
+    }
+
+    int segNum(int sent_i) const {
+        return seg_nums_.at(sent_i);
+    }
+
+    int bucketNum() const {
+        return buckets_.size();
+    }
+
+    double batchCost(const std::vector<int> &batch) const {
+        double ret = 0;
+        for (int sent_i : batch) {
+            ret += costs_.at(sent_i);
+        }
+        return ret;
+    }
+
+    std::vector<std::vector<int>> batches(const BatchBudget &budget, unsigned seed) const {
+        std::default_random_engine engine(seed);
+        std::vector<std::vector<int>> ret;
+        for (std::vector<int> bucket : buckets_) {
+            std::shuffle(bucket.begin(), bucket.end(), engine);
+            for (auto it = bucket.begin(); it != bucket.end();) {
+                std::vector<int> batch;
+                int seg_sum = 0;
+                double cost_sum = 0;
+                while (it != bucket.end() && seg_sum < budget.max_seg_num &&
+                        cost_sum < budget.max_cost) {
+                    seg_sum += seg_nums_.at(*it);
+                    cost_sum += costs_.at(*it);
+                    batch.push_back(*it++);
+                }
+                ret.push_back(std::move(batch));
+            }
+        }
+        if (bucketed_) {
+            std::shuffle(ret.begin(), ret.end(), engine);
+        }
+        return ret;
+    }
+
+private:
+    bool bucketed_;
+    std::vector<int> seg_nums_;
+    // Estimated by EncoderCost. Floats halve the memory and are precise enough for budgeting.
+    std::vector<float> costs_;
+    std::vector<std::vector<int>> buckets_;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "cxxopts.hpp"
+#include "insnet/insnet.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "common.h"
+#include "def.h"
+#include "word_enc_cache.h"
+#include "model/params.h"
+#include "model/model.h"
+#include "model/random_model.h"
+#include "model/static_engine.h"
+
+using cxxopts::Options;
+using std::string;
+using std::cout;
+using std::endl;
+using std::vector;
+using insnet::dtype;
+using insnet::Vocab;
+
+// Every call to the global allocation functions, whoever makes it, so that heap calls the arena
+// never sees are counted too.
+std::atomic<int64_t> new_num = 0;
+
+void *countedAlloc(size_t size, size_t alignment) {
+    ++new_num;
+    size = size == 0 ? 1 : size;
+    void *ret = alignment <= alignof(std::max_align_t) ? std::malloc(size) :
+        std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (ret == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+void *operator new(size_t size) {
+    return countedAlloc(size, alignof(std::max_align_t));
+}
+
+void *operator new[](size_t size) {
+    return countedAlloc(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    return countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+// The heap calls f makes per doc over doc_num docs.
+template <typename F>
+double newsPerDoc(int doc_num, const F &f) {
+    int64_t begin = new_num;
+    f();
+    return static_cast<double>(new_num - begin) / doc_num;
+}
+
+// Counts the heap calls what_lang's engine path makes per doc: docs run on the engine out of an
+// arena reset after each, as a what_lang worker runs them, with no word cache, with a cache being
+// filled, with a warm one and with a full one that evicts on every miss. Segments are read as views
+// of the doc's ids and a full cache reuses what it evicts, so once the arena has grown to fit the
+// docs only the cache being filled makes heap calls; returns 1 if any other case makes one.
+//
+// Tokenizing a doc and the graph path are not counted: insnet allocates the nodes of every graph.
+int main(int argc, const char *argv[]) {
+    Options options("bench_alloc");
+    options.add_options()
+        ("model", "load model, or leave empty for a small one with random weights",
+         cxxopts::value<string>()->default_value(""))
+        ("dim", "dim of the random model", cxxopts::value<int>()->default_value("64"))
+        ("docs", "number of random docs", cxxopts::value<int>()->default_value("200"))
+        ("words", "number of words in a doc", cxxopts::value<int>()->default_value("200"))
+        ("word_cache_size", "max number of word encodings in the cache",
+         cxxopts::value<int>()->default_value("100000"))
+        ("small_cache_size", "max number of word encodings in a cache too small for the docs",
+         cxxopts::value<int>()->default_value("256"))
+        ("seed", "random seed", cxxopts::value<int>()->default_value("0"));
+    auto args = options.parse(argc, argv);
+
+    ModelParams params;
+    Vocab vocab, class_vocab;
+    std::mt19937 engine(args["seed"].as<int>());
+    string model_file = args["model"].as<string>();
+    if (model_file.empty()) {
+        vector<string> chars = {UNK, WORD_SYMBOL, SEG_SYMBOL};
+        for (int i = 0; i < 50; ++i) {
+            chars.push_back(fmt::format("c{}", i));
+        }
+        vocab.init(chars);
+        params.init(vocab, args["dim"].as<int>(), 2, 4, 2, 4, 2, 1024, 5);
+        randomize(params, engine);
+    } else {
+        loadModel(params, vocab, class_vocab, model_file);
+    }
+    StaticEngine static_engine(params);
+
+    int word_symbol_id = vocab.from_string(WORD_SYMBOL);
+    int seg_symbol_id = vocab.from_string(SEG_SYMBOL);
+    int doc_num = args["docs"].as<int>();
+    vector<vector<int>> docs;
+    for (int i = 0; i < doc_num; ++i) {
+        docs.push_back(randomDoc(args["words"].as<int>(), vocab.size() - 3, word_symbol_id,
+                    engine));
+    }
+
+    EarlyExitPolicy policy;
+    Arena arena;
+    int64_t seg_num_sum = 0;
+    auto run_docs = [&](const WordEncSources &sources) {
+        for (const vector<int> &doc : docs) {
+            int seg_num;
+            {
+                std::pmr::vector<dtype> log_prob = earlyExitSentEnc(doc, 64, seg_symbol_id,
+                        static_engine, vocab, policy, seg_num, sources, &arena);
+            }
+            arena.reset();
+            seg_num_sum += seg_num;
+        }
+    };
+
+    // The first pass grows the arena to fit the largest doc.
+    run_docs({});
+    const ArenaStats &arena_stats = arenaStats();
+    int64_t grow_num = arena_stats.grow_num;
+    int64_t overflow_alloc_num = arena_stats.overflow_alloc_num;
+    seg_num_sum = 0;
+    double uncached_news = newsPerDoc(doc_num, [&]() {
+        run_docs({});
+    });
+
+    WordEncCache cache(args["word_cache_size"].as<int>(), 16);
+    WordEncSources sources = {nullptr, &cache};
+    double filling_news = newsPerDoc(doc_num, [&]() {
+        run_docs(sources);
+    });
+    double warm_news = newsPerDoc(doc_num, [&]() {
+        run_docs(sources);
+    });
+
+    WordEncCache small_cache(args["small_cache_size"].as<int>(), 16);
+    WordEncSources small_sources = {nullptr, &small_cache};
+    run_docs(small_sources);
+    int64_t eviction_num = small_cache.evictionNum();
+    double evicting_news = newsPerDoc(doc_num, [&]() {
+        run_docs(small_sources);
+    });
+
+    cout << fmt::format("docs:{} segments per doc:{:.1f} arena capacity:{}", doc_num,
+            static_cast<double>(seg_num_sum) / doc_num, arena.capacity()) << endl;
+    cout << fmt::format("steady state arena grows:{} overflow allocations:{}",
+            arena_stats.grow_num - grow_num,
+            arena_stats.overflow_alloc_num - overflow_alloc_num) << endl;
+    cout << fmt::format("heap calls per doc without a cache:{:.2f}", uncached_news) << endl;
+    cout << fmt::format("heap calls per doc with a cache filling:{:.2f} warm:{:.2f} (size:{})",
+            filling_news, warm_news, cache.size()) << endl;
+    cout << fmt::format("heap calls per doc with a full cache:{:.2f} (evictions per doc:{:.1f})",
+            evicting_news, static_cast<double>(small_cache.evictionNum() - eviction_num) /
+            doc_num) << endl;
+
+    return uncached_news == 0 && warm_news == 0 && evicting_news == 0 ? 0 : 1;
+}
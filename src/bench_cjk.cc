@@ -0,0 +1,108 @@
+#include "cxxopts.hpp"
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include "data_manager.h"
+
+using cxxopts::Options;
+using std::string;
+using std::cout;
+using std::endl;
+using std::vector;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+// The classifier isCJK replaced, checking the ranges one after another.
+bool isCJKByRanges(char32_t ch) {
+    for (const CharRange &range : CJK_RANGES) {
+        if (ch >= range.begin && ch <= range.end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The ASCII scan asciiPrefixLength replaced, one byte at a time.
+size_t asciiPrefixLengthByBytes(const char *data, size_t size) {
+    size_t i = 0;
+    while (i < size && !(static_cast<unsigned char>(data[i]) & 0x80)) {
+        ++i;
+    }
+    return i;
+}
+
+// Returns the nanoseconds f takes per item over item_num items, keeping its result alive in sink.
+template <typename F>
+double nsPerItem(size_t item_num, int64_t &sink, const F &f) {
+    auto begin = steady_clock::now();
+    sink += f();
+    duration<double, std::nano> elapsed = steady_clock::now() - begin;
+    return elapsed.count() / item_num;
+}
+
+// Compares isCJK and asciiPrefixLength with the code they replaced: checks that both classify
+// every code point alike, then times them on random chars and on ASCII text.
+int main(int argc, const char *argv[]) {
+    Options options("bench_cjk");
+    options.add_options()
+        ("chars", "number of random code points to classify",
+         cxxopts::value<int>()->default_value("10000000"))
+        ("cjk_ratio", "ratio of the random code points drawn from CJK ranges",
+         cxxopts::value<float>()->default_value("0.5"))
+        ("ascii_bytes", "length of the ASCII text to scan",
+         cxxopts::value<int>()->default_value("100000000"))
+        ("seed", "random seed", cxxopts::value<int>()->default_value("0"));
+    auto args = options.parse(argc, argv);
+
+    for (char32_t ch = 0; ch < 0x110000; ++ch) {
+        if (isCJK(ch) != isCJKByRanges(ch)) {
+            std::cerr << fmt::format("isCJK differs at U+{:X}", static_cast<uint32_t>(ch)) << endl;
+            return 1;
+        }
+    }
+    cout << "isCJK matches the range checks on every code point" << endl;
+
+    std::mt19937 engine(args["seed"].as<int>());
+    float cjk_ratio = args["cjk_ratio"].as<float>();
+    std::bernoulli_distribution is_cjk(cjk_ratio);
+    std::uniform_int_distribution<char32_t> any_char(0, 0x10ffff);
+    std::uniform_int_distribution<char32_t> cjk_char(0x4e00, 0x9fef);
+    vector<char32_t> chars(args["chars"].as<int>());
+    for (char32_t &ch : chars) {
+        ch = is_cjk(engine) ? cjk_char(engine) : any_char(engine);
+    }
+    int64_t sink = 0;
+    auto count_cjk = [&](bool (*classify)(char32_t)) {
+        return [&chars, classify]() {
+            int64_t ret = 0;
+            for (char32_t ch : chars) {
+                ret += classify(ch);
+            }
+            return ret;
+        };
+    };
+    double old_ns = nsPerItem(chars.size(), sink, count_cjk(isCJKByRanges));
+    double new_ns = nsPerItem(chars.size(), sink, count_cjk(isCJK));
+    cout << fmt::format("classify {} chars, {}% CJK: ranges {:.2f} ns/char, table {:.2f} ns/char",
+            chars.size(), cjk_ratio * 100, old_ns, new_ns) << endl;
+
+    string text(args["ascii_bytes"].as<int>(), 'a');
+    for (size_t i = 0; i < text.size(); i += 7) {
+        text.at(i) = ' ';
+    }
+    auto scan = [&](size_t (*prefix_length)(const char *, size_t)) {
+        return [&text, prefix_length]() {
+            return static_cast<int64_t>(prefix_length(text.data(), text.size()));
+        };
+    };
+    old_ns = nsPerItem(text.size(), sink, scan(asciiPrefixLengthByBytes));
+    new_ns = nsPerItem(text.size(), sink, scan(asciiPrefixLength));
+    cout << fmt::format("scan {} ASCII bytes: bytewise {:.3f} ns/byte, vectorized {:.3f} ns/byte",
+            text.size(), old_ns, new_ns) << endl;
+
+    cout << "checksum:" << sink << endl;
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include "cxxopts.hpp"
+#include "insnet/insnet.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "data_manager.h"
+#include "def.h"
+#include "common.h"
+#include "mapped_file.h"
+#include "worker_pool.h"
+#include "word_table.h"
+#include "model/params.h"
+#include "model/model.h"
+
+using cxxopts::Options;
+using std::string;
+using std::string_view;
+using std::cout;
+using std::endl;
+using std::vector;
+using std::pair;
+using std::unordered_map;
+using insnet::dtype;
+using insnet::Vocab;
+
+using WordCounts = unordered_map<vector<int>, int64_t, IdsHash>;
+
+// Counts the words of sent the way Segmenter cuts them, each starting with its <WORD> symbol.
+void countWords(const vector<int> &sent, int word_symbol_id, WordCounts &counts) {
+    vector<int> word;
+    for (int id : sent) {
+        if (id == word_symbol_id || id == -1) {
+            if (!word.empty()) {
+                ++counts[word];
+                word.clear();
+            }
+            if (id == -1) {
+                continue;
+            }
+        }
+        if (!word.empty() || id == word_symbol_id) {
+            word.push_back(id);
+        }
+    }
+    if (!word.empty()) {
+        ++counts[word];
+    }
+}
+
+// Runs the word encoder over the most frequent words of a reference corpus and writes their
+// encodings as a word table for what_lang, reporting how much of the corpus the table covers.
+int main(int argc, const char *argv[]) {
+    Options options("build_word_table");
+    options.add_options()
+        ("model", "load model", cxxopts::value<string>()->default_value("./model"))
+        ("corpus", "reference corpus dir to count words in", cxxopts::value<string>())
+        ("size", "number of most frequent words to encode",
+         cxxopts::value<int>()->default_value("100000"))
+        ("output", "where to write the word table",
+         cxxopts::value<string>()->default_value("word.table"))
+        ("ratio", "ratio of the corpus lines to count", cxxopts::value<float>()->default_value("1"))
+        ("batch_size", "number of words encoded in one graph",
+         cxxopts::value<int>()->default_value("1024"))
+        ("threads", "number of worker threads", cxxopts::value<int>()->default_value("1"));
+
+    auto args = options.parse(argc, argv);
+    int table_size = args["size"].as<int>();
+    float ratio = args["ratio"].as<float>();
+    int batch_size = args["batch_size"].as<int>();
+    int thread_num = args["threads"].as<int>();
+
+    ModelParams params;
+    Vocab vocab, class_vocab;
+    string model_file = args["model"].as<string>();
+    loadModel(params, vocab, class_vocab, model_file);
+    CharVocab char_vocab(vocab.m_string_to_id);
+    int word_symbol_id = vocab.from_string(WORD_SYMBOL);
+
+    vector<string> files = corpusFiles(args["corpus"].as<string>());
+    vector<WordCounts> file_counts(files.size());
+    parallelFor(files.size(), thread_num, [&](int file_i) {
+        MappedFile file(files.at(file_i));
+        LineReader reader(file);
+        string_view line;
+        for (int line_num = 0; reader.next(line); ++line_num) {
+            if (line_num % 100 < ratio * 100) {
+                auto ids = splitIntoWords(line.data(), line.size(), char_vocab);
+                countWords(ids, word_symbol_id, file_counts.at(file_i));
+            }
+        }
+    });
+
+    WordCounts counts;
+    for (WordCounts &file_count : file_counts) {
+        for (const auto &it : file_count) {
+            counts[it.first] += it.second;
+        }
+        file_count = WordCounts();
+    }
+    vector<pair<vector<int>, int64_t>> ranked(counts.begin(), counts.end());
+    counts = WordCounts();
+    // Ties are broken by the ids, so that the same corpus always gives the same table.
+    std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    int64_t occurrence_num = 0;
+    for (const auto &it : ranked) {
+        occurrence_num += it.second;
+    }
+    cout << fmt::format("distinct words:{} occurrences:{}", ranked.size(), occurrence_num) << endl;
+
+    table_size = std::min<int64_t>(table_size, ranked.size());
+    int64_t covered_num = 0;
+    for (int i = 0, report_at = 10; i < table_size; ++i) {
+        covered_num += ranked.at(i).second;
+        if (i + 1 == report_at || i + 1 == table_size) {
+            cout << fmt::format("top {} words cover {:.2f}% of occurrences", i + 1,
+                    occurrence_num == 0 ? 0.0 : 100.0 * covered_num / occurrence_num) << endl;
+            report_at *= 10;
+        }
+    }
+
+    vector<vector<int>> words;
+    words.reserve(table_size);
+    for (int i = 0; i < table_size; ++i) {
+        words.push_back(std::move(ranked.at(i).first));
+    }
+    ranked = decltype(ranked)();
+
+    int dim = params.word_enc.hiddenDim();
+    vector<dtype> vectors(static_cast<size_t>(table_size) * dim);
+    int batch_num = (table_size + batch_size - 1) / batch_size;
+    parallelFor(batch_num, thread_num, [&](int batch_i) {
+        int begin = batch_i * batch_size;
+        int end = std::min(begin + batch_size, table_size);
+        insnet::Graph graph(insnet::ModelStage::INFERENCE);
+        vector<insnet::Node *> encs;
+        for (int i = begin; i < end; ++i) {
+            encs.push_back(wordEnc(words.at(i), graph, params, 0));
+        }
+        graph.forward();
+        for (int i = begin; i < end; ++i) {
+            vector<dtype> vals = nodeValues(*encs.at(i - begin));
+            std::copy(vals.begin(), vals.end(), vectors.begin() + static_cast<size_t>(i) * dim);
+        }
+    });
+
+    string output = args["output"].as<string>();
+    writeWordTable(output, fileHash(model_file), dim, words, vectors);
+    cout << fmt::format("{} words written to {}", words.size(), output) << endl;
+
+    return 0;
+}
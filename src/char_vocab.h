@@ -0,0 +1,133 @@
+#ifndef LANG_ID_CHAR_VOCAB_H
+#define LANG_ID_CHAR_VOCAB_H
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "def.h"
+
+// What decodeUtf8 gives for bytes that are not well-formed UTF-8. It is past the Unicode range, so
+// CharVocab looks it up as UNK rather than as a char whose encoding the bytes resemble.
+inline constexpr char32_t INVALID_CODE_POINT = 0xffffffff;
+
+// Decodes the code point starting at data and returns its length in bytes. Lengths are read from
+// the leading byte as tinyutf8 reads them, so lines split into the same chars, but a sequence that
+// is truncated, stray, overlong or past U+10FFFF decodes to INVALID_CODE_POINT.
+inline int decodeUtf8(const char *data, size_t data_left, char32_t &ch) {
+    // The smallest code point that needs each length, below which an encoding is overlong.
+    static constexpr char32_t MIN_CODE_POINTS[] = {0, 0, 0x80, 0x800, 0x10000};
+    unsigned char first = static_cast<unsigned char>(*data);
+    int bytes = 1;
+    bool valid = true;
+    if (first & 0x80) {
+        int leading_ones = __builtin_clz(~(static_cast<unsigned int>(first) << 24));
+        if (static_cast<size_t>(leading_ones - 1) < data_left) {
+            bytes = leading_ones;
+        }
+        valid = bytes == leading_ones && bytes >= 2 && bytes <= 4;
+    }
+    char32_t cp = first;
+    if (bytes > 1) {
+        cp &= 0x7f >> bytes;
+        for (int i = 1; i < bytes; ++i) {
+            unsigned char byte = static_cast<unsigned char>(data[i]);
+            valid = valid && (byte & 0xc0) == 0x80;
+            cp = (cp << 6) | (byte & 0x3f);
+        }
+        valid = valid && cp >= MIN_CODE_POINTS[bytes] && cp <= 0x10ffff;
+    }
+    ch = valid ? cp : INVALID_CODE_POINT;
+    return bytes;
+}
+
+inline void appendUtf8(char32_t cp, std::string &out) {
+    if (cp < 0x80) {
+        out.push_back(cp);
+    } else if (cp < 0x800) {
+        out.push_back(0xc0 | (cp >> 6));
+        out.push_back(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out.push_back(0xe0 | (cp >> 12));
+        out.push_back(0x80 | ((cp >> 6) & 0x3f));
+        out.push_back(0x80 | (cp & 0x3f));
+    } else {
+        out.push_back(0xf0 | (cp >> 18));
+        out.push_back(0x80 | ((cp >> 12) & 0x3f));
+        out.push_back(0x80 | ((cp >> 6) & 0x3f));
+        out.push_back(0x80 | (cp & 0x3f));
+    }
+}
+
+// Character vocabulary keyed by code point. BMP chars are looked up in a dense table and astral
+// chars in a sorted array, so no string is built or hashed per char.
+class CharVocab {
+public:
+    static constexpr char32_t BMP_SIZE = 0x10000;
+
+    CharVocab() = default;
+
+    explicit CharVocab(const std::unordered_map<std::string, int> &string_to_id) {
+        init(string_to_id);
+    }
+
+    void init(const std::unordered_map<std::string, int> &string_to_id) {
+        unk_id_ = string_to_id.at(UNK);
+        word_symbol_id_ = string_to_id.at(WORD_SYMBOL);
+        seg_symbol_id_ = string_to_id.at(SEG_SYMBOL);
+        bmp_ids_.assign(BMP_SIZE, unk_id_);
+        astral_ids_.clear();
+
+        for (const auto &it : string_to_id) {
+            const std::string &str = it.first;
+            if (str.empty()) {
+                continue;
+            }
+            char32_t ch;
+            int bytes = decodeUtf8(str.data(), str.size(), ch);
+            if (bytes != str.size() || ch == INVALID_CODE_POINT) {
+                // The special symbols are multi-char strings and malformed ones decode to UNK, so
+                // neither comes out of the tokenizer.
+                continue;
+            }
+            if (ch < BMP_SIZE) {
+                bmp_ids_.at(ch) = it.second;
+            } else {
+                astral_ids_.push_back(std::make_pair(ch, it.second));
+            }
+        }
+        std::sort(astral_ids_.begin(), astral_ids_.end());
+    }
+
+    int id(char32_t ch) const {
+        if (ch < BMP_SIZE) {
+            return bmp_ids_[ch];
+        }
+        auto it = std::lower_bound(astral_ids_.begin(), astral_ids_.end(),
+                std::make_pair(ch, std::numeric_limits<int>::min()));
+        return it != astral_ids_.end() && it->first == ch ? it->second : unk_id_;
+    }
+
+    int unkId() const {
+        return unk_id_;
+    }
+
+    int wordSymbolId() const {
+        return word_symbol_id_;
+    }
+
+    int segSymbolId() const {
+        return seg_symbol_id_;
+    }
+
+private:
+    std::vector<int> bmp_ids_;
+    std::vector<std::pair<char32_t, int>> astral_ids_;
+    int unk_id_ = -1;
+    int word_symbol_id_ = -1;
+    int seg_symbol_id_ = -1;
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include "cxxopts.hpp"
+#include "insnet/insnet.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "def.h"
+#include "model/params.h"
+#include "model/model.h"
+#include "model/int8_kernels.h"
+#include "model/random_model.h"
+#include "model/static_engine.h"
+
+using cxxopts::Options;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::vector;
+using insnet::dtype;
+using insnet::Vocab;
+
+// Checks dotInt8 against a plain int32 loop on random vectors of every stride up to max_stride,
+// the extremes -127 and 127 included, and that quantizeInt8 gives back each value within half a
+// scale and pads with zeros. Returns the number of failed checks.
+int checkInt8Kernels(int max_stride, std::mt19937 &engine) {
+    std::uniform_int_distribution<int> int8_dist(-127, 127);
+    std::uniform_real_distribution<float> float_dist(-4, 4);
+    int failed_num = 0;
+    for (int stride = INT8_BLOCK; stride <= max_stride; stride += INT8_BLOCK) {
+        for (int round = 0; round < 16; ++round) {
+            vector<int8_t> a(stride), b(stride);
+            for (int i = 0; i < stride; ++i) {
+                a.at(i) = round == 0 ? 127 : round == 1 ? -127 : int8_dist(engine);
+                b.at(i) = round == 0 || round == 1 ? -127 : int8_dist(engine);
+            }
+            int32_t expected = 0;
+            for (int i = 0; i < stride; ++i) {
+                expected += static_cast<int32_t>(a.at(i)) * b.at(i);
+            }
+            int32_t dot = dotInt8(a.data(), b.data(), stride);
+            if (dot != expected) {
+                ++failed_num;
+                cerr << fmt::format("dotInt8 of stride {} is {} but {} expected", stride, dot,
+                        expected) << endl;
+            }
+        }
+
+        int dim = stride - INT8_BLOCK / 2;
+        vector<float> x(dim);
+        for (float &v : x) {
+            v = float_dist(engine);
+        }
+        vector<int8_t> q(int8Stride(dim), 1);
+        float scale = quantizeInt8(x.data(), dim, q.data());
+        for (int i = 0; i < q.size(); ++i) {
+            float expected = i < dim ? x.at(i) : 0;
+            if (!(std::abs(q.at(i) * scale - expected) <= scale * 0.5f + 1e-6f)) {
+                ++failed_num;
+                cerr << fmt::format("quantizeInt8 of dim {} gives {} for {} at {}", dim,
+                        q.at(i) * scale, expected, i) << endl;
+                break;
+            }
+        }
+    }
+    return failed_num;
+}
+
+// Checks StaticEngine against the graphs on a small model with random weights: both read every
+// segment of random docs, and the log probs of the last segment must agree within tolerance. A
+// quantized copy of the engine must agree with the graphs within int8_tolerance and predict the
+// same class on at least min_int8_agreement of the docs, after the int8 kernels pass their own
+// checks. Returns 1 if any check fails.
+int main(int argc, const char *argv[]) {
+    Options options("check_engine");
+    options.add_options()
+        ("dim", "dim", cxxopts::value<int>()->default_value("32"))
+        ("word_layer", "word layer", cxxopts::value<int>()->default_value("2"))
+        ("word_head", "word head", cxxopts::value<int>()->default_value("4"))
+        ("seg_layer", "seg layer", cxxopts::value<int>()->default_value("2"))
+        ("seg_head", "seg head", cxxopts::value<int>()->default_value("4"))
+        ("sent_layer", "sent layer", cxxopts::value<int>()->default_value("2"))
+        ("class_num", "number of classes", cxxopts::value<int>()->default_value("5"))
+        ("char_num", "number of chars in the vocab", cxxopts::value<int>()->default_value("50"))
+        ("docs", "number of random docs", cxxopts::value<int>()->default_value("20"))
+        ("words", "number of words in a doc", cxxopts::value<int>()->default_value("200"))
+        ("tolerance", "largest allowed difference of a log prob",
+         cxxopts::value<float>()->default_value("1e-3"))
+        ("int8_tolerance", "largest allowed difference of a log prob of the quantized engine",
+         cxxopts::value<float>()->default_value("0.5"))
+        ("min_int8_agreement", "least share of docs the quantized engine must classify alike",
+         cxxopts::value<float>()->default_value("0.9"))
+        ("seed", "random seed", cxxopts::value<int>()->default_value("0"));
+    auto args = options.parse(argc, argv);
+
+    int char_num = args["char_num"].as<int>();
+    vector<string> chars = {UNK, WORD_SYMBOL, SEG_SYMBOL};
+    for (int i = 0; i < char_num; ++i) {
+        chars.push_back(fmt::format("c{}", i));
+    }
+    Vocab vocab;
+    vocab.init(chars);
+
+    ModelParams params;
+    params.init(vocab, args["dim"].as<int>(), args["word_layer"].as<int>(),
+            args["word_head"].as<int>(), args["seg_layer"].as<int>(),
+            args["seg_head"].as<int>(), args["sent_layer"].as<int>(), 1024,
+            args["class_num"].as<int>());
+    std::mt19937 engine(args["seed"].as<int>());
+    randomize(params, engine);
+    StaticEngine static_engine(params);
+    StaticEngine quantized_engine(params);
+    quantized_engine.quantize();
+
+    int kernel_failed_num = checkInt8Kernels(16 * INT8_BLOCK, engine);
+    cout << fmt::format("int8 kernel checks failed:{}", kernel_failed_num) << endl;
+
+    int word_symbol_id = vocab.from_string(WORD_SYMBOL);
+    int seg_symbol_id = vocab.from_string(SEG_SYMBOL);
+    EarlyExitPolicy read_all;
+    read_all.prob_threshold = 2;
+    read_all.margin = 2;
+    read_all.max_seg_num = std::numeric_limits<int>::max();
+    float tolerance = args["tolerance"].as<float>();
+    float int8_tolerance = args["int8_tolerance"].as<float>();
+    int doc_num = args["docs"].as<int>();
+    int failed_num = 0, int8_failed_num = 0, int8_agreed_num = 0;
+    dtype max_diff = 0, max_int8_diff = 0;
+    auto log_prob_diff = [](const vector<dtype> &a, const std::pmr::vector<dtype> &b) {
+        dtype diff = 0;
+        for (int i = 0; i < a.size(); ++i) {
+            diff = std::max(diff, std::abs(a.at(i) - b.at(i)));
+        }
+        return diff;
+    };
+    auto predicted = [](const auto &log_prob) {
+        return std::max_element(log_prob.begin(), log_prob.end()) - log_prob.begin();
+    };
+    for (int doc_i = 0; doc_i < doc_num; ++doc_i) {
+        vector<int> doc = randomDoc(args["words"].as<int>(), char_num, word_symbol_id, engine);
+        int graph_seg_num, engine_seg_num;
+        vector<dtype> graph_log_prob = earlyExitSentEnc(doc, 64, seg_symbol_id, params, read_all,
+                graph_seg_num);
+        std::pmr::vector<dtype> engine_log_prob = earlyExitSentEnc(doc, 64, seg_symbol_id,
+                static_engine, vocab, read_all, engine_seg_num);
+        dtype diff = std::numeric_limits<dtype>::infinity();
+        if (graph_seg_num == engine_seg_num && graph_log_prob.size() == engine_log_prob.size()) {
+            diff = log_prob_diff(graph_log_prob, engine_log_prob);
+        }
+        max_diff = std::max(max_diff, diff);
+        if (!(diff <= tolerance)) {
+            ++failed_num;
+            cerr << fmt::format("doc {} differs: segments graph:{} engine:{} log prob diff:{}",
+                    doc_i, graph_seg_num, engine_seg_num, diff) << endl;
+        }
+
+        int int8_seg_num;
+        std::pmr::vector<dtype> int8_log_prob = earlyExitSentEnc(doc, 64, seg_symbol_id,
+                quantized_engine, vocab, read_all, int8_seg_num);
+        dtype int8_diff = std::numeric_limits<dtype>::infinity();
+        if (graph_seg_num == int8_seg_num && graph_log_prob.size() == int8_log_prob.size()) {
+            int8_diff = log_prob_diff(graph_log_prob, int8_log_prob);
+            int8_agreed_num += predicted(graph_log_prob) == predicted(int8_log_prob);
+        }
+        max_int8_diff = std::max(max_int8_diff, int8_diff);
+        if (!(int8_diff <= int8_tolerance)) {
+            ++int8_failed_num;
+            cerr << fmt::format("doc {} differs: segments graph:{} int8:{} log prob diff:{}",
+                    doc_i, graph_seg_num, int8_seg_num, int8_diff) << endl;
+        }
+    }
+    cout << fmt::format("{} of {} docs within {} of the graphs, max log prob diff:{}",
+            doc_num - failed_num, doc_num, tolerance, max_diff) << endl;
+    cout << fmt::format("int8: {} of {} docs within {} of the graphs, max log prob diff:{}, "
+            "predictions agreed on {} docs", doc_num - int8_failed_num, doc_num, int8_tolerance,
+            max_int8_diff, int8_agreed_num) << endl;
+    bool int8_agreed = int8_agreed_num >= args["min_int8_agreement"].as<float>() * doc_num;
+    if (!int8_agreed) {
+        cerr << fmt::format("int8 predictions agreed on fewer than {} of the docs",
+                args["min_int8_agreement"].as<float>()) << endl;
+    }
+
+    return failed_num == 0 && kernel_failed_num == 0 && int8_failed_num == 0 && int8_agreed ?
+        0 : 1;
+}
@@ -0,0 +1,82 @@
+#include "cxxopts.hpp"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "def.h"
+#include "char_vocab.h"
+#include "data_manager.h"
+
+using cxxopts::Options;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::vector;
+
+vector<string> readLines(const string &path) {
+    std::ifstream is(path);
+    if (!is) {
+        cerr << fmt::format("open {} fail", path) << endl;
+        abort();
+    }
+    vector<string> lines;
+    string line;
+    while (std::getline(is, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// Checks splitIntoWords against ids the original utf8_string tokenizer gave for a mixed CJK and
+// Latin corpus. The dir holds vocab.txt, one char per line with its line number as its id,
+// corpus.txt, and expected_ids.txt, the ids of each corpus line separated by spaces. The corpus is
+// well-formed UTF-8, since malformed sequences that decode into a CJK range no longer break words
+// as CJK chars do. Returns 1 if any line is tokenized differently.
+int main(int argc, const char *argv[]) {
+    Options options("check_tokenizer");
+    options.add_options()
+        ("dir", "dir of the golden files",
+         cxxopts::value<string>()->default_value("test/tokenizer"));
+    auto args = options.parse(argc, argv);
+    string dir = args["dir"].as<string>();
+
+    std::unordered_map<string, int> string_to_id;
+    for (const string &str : readLines(dir + "/vocab.txt")) {
+        int id = string_to_id.size();
+        string_to_id.emplace(str, id);
+    }
+    CharVocab vocab(string_to_id);
+
+    vector<string> corpus = readLines(dir + "/corpus.txt");
+    vector<string> expected_lines = readLines(dir + "/expected_ids.txt");
+    if (corpus.size() != expected_lines.size()) {
+        cerr << fmt::format("corpus has {} lines but expected_ids has {}", corpus.size(),
+                expected_lines.size()) << endl;
+        return 1;
+    }
+    int failed_num = 0;
+    for (int i = 0; i < corpus.size(); ++i) {
+        vector<int> expected;
+        std::istringstream ss(expected_lines.at(i));
+        for (int id; ss >> id;) {
+            expected.push_back(id);
+        }
+        vector<int> ids = splitIntoWords(corpus.at(i), vocab);
+        if (ids != expected) {
+            ++failed_num;
+            size_t diff_i = 0;
+            while (diff_i < ids.size() && diff_i < expected.size() &&
+                    ids.at(diff_i) == expected.at(diff_i)) {
+                ++diff_i;
+            }
+            cerr << fmt::format("line {} differs at id {}: {} ids but {} expected", i + 1, diff_i,
+                    ids.size(), expected.size()) << endl;
+        }
+    }
+    cout << fmt::format("{} of {} lines tokenized as expected", corpus.size() - failed_num,
+            corpus.size()) << endl;
+
+    return failed_num == 0 ? 0 : 1;
+}
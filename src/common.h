@@ -1,9 +1,54 @@
 #ifndef LANG_ID_COMMON_H
 #define LANG_ID_COMMON_H
 
+#include <vector>
 #include "insnet/insnet.h"
 #include "model/params.h"
 
+inline float F1(float correct, float predicted, float golden) {
+    return 2 * correct / (predicted + golden + 1e-10);
+}
+
+// Counts predictions against golden classes for per-class and macro F1. A predicted class of -1,
+// given to a document with no segment to run, counts as wrong without being any class's.
+class ClassScores {
+public:
+    explicit ClassScores(int class_num) : correct_times_(class_num, 0),
+        predicted_times_(class_num, 0), golden_times_(class_num, 0) {}
+
+    void add(int predicted, int answer) {
+        if (predicted == answer) {
+            correct_times_.at(answer)++;
+        }
+        if (predicted >= 0) {
+            predicted_times_.at(predicted)++;
+        }
+        golden_times_.at(answer)++;
+    }
+
+    int classNum() const {
+        return golden_times_.size();
+    }
+
+    float f1(int class_id) const {
+        return F1(correct_times_.at(class_id), predicted_times_.at(class_id),
+                golden_times_.at(class_id));
+    }
+
+    float macroF1() const {
+        float sum = 0;
+        for (int i = 0; i < classNum(); ++i) {
+            sum += f1(i);
+        }
+        return sum / classNum();
+    }
+
+private:
+    std::vector<float> correct_times_;
+    std::vector<float> predicted_times_;
+    std::vector<float> golden_times_;
+};
+
 inline void loadModel(ModelParams &model_params, insnet::Vocab &vocab, insnet::Vocab &class_vocab,
         const std::string &filename,
         int &iter,
@@ -12,11 +57,12 @@ inline void loadModel(ModelParams &model_params, insnet::Vocab &vocab, insnet::V
         int &word_head,
         int &seg_layer,
         int &seg_head,
-        int &sent_layer) {
-    std::cout << "loading model file..." << std::endl;
+        int &sent_layer,
+        std::ostream &log = std::cout) {
+    log << "loading model file..." << std::endl;
     std::ifstream is(filename.c_str());
     if (is) {
-        std::cout << "loading model..." << std::endl;
+        log << "loading model..." << std::endl;
         cereal::BinaryInputArchive ar(is);
         ar(iter, dim, word_layer, word_head, seg_layer, seg_head, sent_layer, class_vocab, vocab);
         model_params.init(vocab, dim, word_layer, word_head, seg_layer, seg_head, sent_layer, 1024,
@@ -25,7 +71,7 @@ inline void loadModel(ModelParams &model_params, insnet::Vocab &vocab, insnet::V
 #if USE_GPU
         model_params.copyFromHostToDevice();
 #endif
-        std::cout << "model loaded" << std::endl;
+        log << "model loaded" << std::endl;
     } else {
         std::cerr << fmt::format("load model fail - filename:%1%", filename) << std::endl;
         abort();
@@ -33,10 +79,11 @@ inline void loadModel(ModelParams &model_params, insnet::Vocab &vocab, insnet::V
 }
 
 inline void loadModel(ModelParams &model_params, insnet::Vocab &vocab, insnet::Vocab &class_vocab,
-        const std::string &filename) {
+        const std::string &filename,
+        std::ostream &log = std::cout) {
     int iter, dim, word_layer, word_head, seg_layer, seg_head, sent_layer;
     loadModel(model_params, vocab,class_vocab, filename, iter, dim, word_layer, word_head,
-            seg_layer, seg_head, sent_layer);
+            seg_layer, seg_head, sent_layer, log);
 }
 
 #endif
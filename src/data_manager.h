@@ -1,9 +1,13 @@
 #ifndef INSNET_BENCHMARK_DATA_MANAGER_H
 #define INSNET_BENCHMARK_DATA_MANAGER_H
 
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <thread>
 #include <string>
+#include <string_view>
 #include <filesystem>
 #include <unordered_map>
 #include <unordered_set>
@@ -11,30 +15,103 @@
 #include <fstream>
 #include <iterator>
 #include <regex>
+#include <set>
 #include <iostream>
 #include <utility>
 #include <atomic>
 #include <mutex>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "conversation_structure.h"
 #include "tinyutf8.h"
 #include "def.h"
+#include "char_vocab.h"
+#include "mapped_file.h"
+#include "worker_pool.h"
+#include "dataset.h"
 #include "fmt/core.h"
 #include "insnet/insnet.h"
 
-inline bool between(char32_t ch, char32_t begin, char32_t end) {
-    if (begin > end) {
-        std::cerr << begin << end << std::endl;
-        abort();
+struct CharRange {
+    char32_t begin;
+    char32_t end;
+};
+
+inline constexpr CharRange CJK_RANGES[] = {
+    {0x4e00, 0x9fef}, {0x3400, 0x4dbf}, {0x20000, 0x2a6df}, {0x2a700, 0x2b73f},
+    {0x2b740, 0x2b81f}, {0x2b820, 0x2ceaf}, {0x2ceb0, 0x2ebef}, {0x3007, 0x30ff},
+    {0xf900, 0xfa6a}, {0xff5f, 0xff9f},
+};
+
+// Code points at or above this bound are never CJK.
+inline constexpr char32_t CJK_TABLE_SIZE = 0x30000;
+
+constexpr bool validCJKRanges() {
+    for (const CharRange &range : CJK_RANGES) {
+        if (range.begin > range.end || range.end >= CJK_TABLE_SIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(validCJKRanges(), "invalid CJK_RANGES");
+
+// One bit per code point below CJK_TABLE_SIZE, built from CJK_RANGES on first use.
+class CJKTable {
+public:
+    CJKTable() : bits_(CJK_TABLE_SIZE / 64, 0) {
+        for (const CharRange &range : CJK_RANGES) {
+            for (char32_t ch = range.begin; ch <= range.end; ++ch) {
+                bits_.at(ch >> 6) |= 1ull << (ch & 63);
+            }
+        }
+    }
+
+    bool contains(char32_t ch) const {
+        return ch < CJK_TABLE_SIZE && (bits_[ch >> 6] >> (ch & 63) & 1);
     }
-    return ch >= begin && ch <= end;
+
+private:
+    std::vector<uint64_t> bits_;
+};
+
+inline const CJKTable &cjkTable() {
+    static const CJKTable table;
+    return table;
 }
 
 inline bool isCJK(char32_t ch) {
-    return between(ch, 0x4e00, 0x9fef) || between(ch, 0x3400, 0x4dbf) ||
-        between(ch, 0x20000, 0x2a6df) || between(ch, 0x2a700, 0x2b73f) ||
-        between(ch, 0x2b740, 0x2b81f) || between(ch, 0x2b820, 0x2ceaf) ||
-        between(ch, 0x2ceb0, 0x2ebef) || between(ch, 0x3007, 0x30ff) || between(ch, 0xf900, 0xfa6a)
-        || between(ch, 0xff5f, 0xff9f);
+    return cjkTable().contains(ch);
+}
+
+// Returns the number of leading bytes below 0x80. They decode to themselves and are never CJK, so
+// the tokenizer can take them without decoding or classifying.
+inline size_t asciiPrefixLength(const char *data, size_t size) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        unsigned int mask = _mm256_movemask_epi8(bytes);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        unsigned int mask = _mm_movemask_epi8(bytes);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < size && !(static_cast<unsigned char>(data[i]) & 0x80)) {
+        ++i;
+    }
+    return i;
 }
 
 inline std::string langName(const std::string &path) {
@@ -51,46 +128,59 @@ inline std::string langName(const std::string &path) {
     return name.substr(0, end);
 }
 
-inline int charId(const std::unordered_map<std::string, int> &vocab, const std::string &str) {
-    auto it = vocab.find(str);
-    if (it == vocab.end()) {
-        return vocab.at(UNK);
-    } else {
-        return it->second;
-    }
-}
-
-inline std::vector<int> splitIntoWords(const utf8_string &line,
-        const std::unordered_map<std::string, int> &vocab) {
+// Tokenizes with char_id mapping each code point to its id, appending the ids to ret.
+template <typename CharId>
+void appendWords(const char *data, size_t size, int word_symbol_id, const CharId &char_id,
+        std::vector<int> &ret) {
     enum ParsingState {
         IN_WORD = 0,
         IN_SPACE = 1,
         IN_SENT = 2,
     };
 
-    std::vector<int> ret;
     ParsingState state = ParsingState::IN_SPACE;
     int word_len = 0;
-    int word_symbol_id = vocab.at(WORD_SYMBOL);
-    for (int i = 0; i < line.length(); ++i) {
-        char32_t ch = line.at(i);
+
+    // A word longer than 31 chars is fed to the model char by char, so its leading <WORD> marker
+    // is turned into a separator.
+    auto demote_long_word = [&]() {
+        int &id = ret.at(ret.size() - 1 - word_len);
+        if (id != word_symbol_id) {
+            std::cerr << fmt::format("splitIntoWords line:{}", std::string(data, size))
+                << std::endl;
+            abort();
+        }
+        id = -1;
+    };
+
+    // Bytes before ascii_end are known to be ASCII.
+    size_t ascii_end = 0;
+    for (size_t offset = 0; offset < size;) {
+        char32_t ch;
+        bool is_cjk;
+        if (offset >= ascii_end) {
+            ascii_end = offset + asciiPrefixLength(data + offset, size - offset);
+        }
+        if (offset < ascii_end) {
+            ch = static_cast<unsigned char>(data[offset++]);
+            is_cjk = false;
+        } else {
+            offset += decodeUtf8(data + offset, size - offset, ch);
+            is_cjk = isCJK(ch);
+        }
+
         if (ch == ' ') {
             if (state != ParsingState::IN_SPACE) {
                 state = ParsingState::IN_SPACE;
             }
             if (word_len > 31) {
-                int &id = ret.at(ret.size() - 1 - word_len);
-                if (id != word_symbol_id) {
-                    std::cerr << fmt::format("splitIntoWords line:{}", line.cpp_str()) << std::endl;
-                    abort();
-                }
-                id = -1;
+                demote_long_word();
             }
             word_len = 0;
         } else {
             if (state == ParsingState::IN_SPACE) {
                 int symbol = 0;
-                if (isCJK(line.at(i))) {
+                if (is_cjk) {
                     symbol = -1;
                     state = ParsingState::IN_SENT;
                 } else {
@@ -100,14 +190,9 @@ inline std::vector<int> splitIntoWords(const utf8_string &line,
                 }
                 ret.push_back(symbol);
             } else if (state == ParsingState::IN_WORD) {
-                if (isCJK(line.at(i))) {
+                if (is_cjk) {
                     if (word_len > 31) {
-                        int &id = ret.at(ret.size() - 1 - word_len);
-                        if (id != word_symbol_id) {
-                            std::cerr << fmt::format("splitIntoWords line:{}", line.cpp_str()) << std::endl;
-                            abort();
-                        }
-                        id = -1;
+                        demote_long_word();
                     } else {
                         ret.push_back(-1);
                     }
@@ -118,138 +203,310 @@ inline std::vector<int> splitIntoWords(const utf8_string &line,
                     word_len++;
                 }
             } else if (state == ParsingState::IN_SENT) {
-                if (!isCJK(line.at(i))) {
+                if (!is_cjk) {
                     ++word_len;
                     state = ParsingState::IN_WORD;
                     ret.push_back(word_symbol_id);
                 }
             }
 
-            auto str = line.substr(i, 1).cpp_str();
-            int id = charId(vocab, str);
-            ret.push_back(id);
+            ret.push_back(char_id(ch));
         }
     }
     if (word_len > 31) {
-        int &id = ret.at(ret.size() - 1 - word_len);
-        if (id != word_symbol_id) {
-            std::cerr << fmt::format("splitIntoWords line:{}", line.cpp_str()) << std::endl;
-            abort();
-        }
-        id = -1;
+        demote_long_word();
     }
+}
+
+template <typename CharId>
+std::vector<int> splitIntoWords(const char *data, size_t size, int word_symbol_id,
+        const CharId &char_id) {
+    std::vector<int> ret;
+    ret.reserve(size + size / 2);
+    appendWords(data, size, word_symbol_id, char_id, ret);
     return ret;
 }
 
-inline std::pair<std::vector<std::vector<int>>, std::vector<int>> readDataset(
-        const std::string &dir_name,
-        const std::unordered_map<std::string, int> &vocab,
-        const std::unordered_map<std::string, int> &class_vocab,
-        float ratio = 1) {
-    std::vector<std::vector<int>> sent_ret;
-    std::vector<int> class_ret;
-    int sent_num = 0;
-
-    for (const auto &entry : std::filesystem::directory_iterator(dir_name)) {
-        std::cout << fmt::format("sent_num:{} rate:{}", sent_num, sent_num / 15462425.0f) << std::endl;
-        std::string path = entry.path();
-        std::ifstream ifs(path);
-        std::string raw_line;
-        std::string lang_name = langName(path);
+inline std::vector<int> splitIntoWords(const char *data, size_t size, const CharVocab &vocab) {
+    return splitIntoWords(data, size, vocab.wordSymbolId(), [&](char32_t ch) {
+        return vocab.id(ch);
+    });
+}
 
-        int local_sent_num = 0;
-        int read_local_sent_num = 0;
-        int read_sent_num = 0;
-        while (std::getline(ifs, raw_line)) {
-            ++sent_num;
-            ++local_sent_num;
-            if (local_sent_num % 100 >= ratio * 100) {
-                continue;
-            }
-            ++read_sent_num;
-            ++read_local_sent_num;
+inline std::vector<int> splitIntoWords(const std::string &line, const CharVocab &vocab) {
+    return splitIntoWords(line.data(), line.size(), vocab);
+}
 
-            utf8_string line(raw_line);
+inline std::vector<int> splitIntoWords(const utf8_string &line, const CharVocab &vocab) {
+    return splitIntoWords(line.data(), line.size(), vocab);
+}
 
-            auto words = splitIntoWords(line, vocab);
-            if (local_sent_num % 100000 == 1) {
-                std::cout << fmt::format("line:{}", raw_line) << std::endl;
-                for (int id : words) {
-                    std::cout << id << " ";
+// Reads the file at path into content as its lines each followed by a space, replacing newlines in
+// place so that no line is copied on its own. content's storage is reused across calls.
+inline void readJoinedLines(const std::string &path, std::string &content) {
+    std::ifstream ifs(path, std::ios::binary);
+    content.resize(std::filesystem::file_size(path));
+    ifs.read(content.data(), content.size());
+    content.resize(ifs.gcount());
+    bool ends_with_newline = !content.empty() && content.back() == '\n';
+    std::replace(content.begin(), content.end(), '\n', ' ');
+    if (!content.empty() && !ends_with_newline) {
+        content.push_back(' ');
+    }
+}
+
+// Reads a document a block at a time and tokenizes it the way its lines joined by spaces would be
+// tokenized, so that callers can stop reading once they have seen enough of it. Blocks are cut
+// after their last space, where splitIntoWords holds no state.
+class DocumentTokenizer {
+public:
+    DocumentTokenizer(const std::string &path, const CharVocab &vocab, size_t block_size = 1 << 16)
+        : ifs_(path, std::ios::binary), vocab_(vocab), block_size_(block_size) {}
+
+    // Tokenizes the next part of the document into ids and returns false once it is used up.
+    bool next(std::vector<int> &ids) {
+        while (!eof_) {
+            size_t old_size = buffer_.size();
+            buffer_.resize(old_size + block_size_);
+            ifs_.read(&buffer_.at(old_size), block_size_);
+            buffer_.resize(old_size + ifs_.gcount());
+            for (size_t i = old_size; i < buffer_.size(); ++i) {
+                ends_with_newline_ = buffer_.at(i) == '\n';
+                if (ends_with_newline_) {
+                    buffer_.at(i) = ' ';
+                }
+            }
+
+            if (!ifs_) {
+                eof_ = true;
+                if (!buffer_.empty() && !ends_with_newline_) {
+                    buffer_.push_back(' ');
                 }
-                std::cout << std::endl;
+                ids = splitIntoWords(buffer_, vocab_);
+                buffer_.clear();
+                return true;
             }
 
-            sent_ret.push_back(move(words));
-            int class_id = class_vocab.at(lang_name);
-            class_ret.push_back(class_id);
+            size_t cut = buffer_.rfind(' ');
+            if (cut != std::string::npos) {
+                ids = splitIntoWords(buffer_.data(), cut + 1, vocab_);
+                buffer_.erase(0, cut + 1);
+                return true;
+            }
         }
+        return false;
     }
 
-    return std::make_pair(sent_ret, class_ret);
-}
+private:
+    std::ifstream ifs_;
+    const CharVocab &vocab_;
+    size_t block_size_;
+    std::string buffer_;
+    bool ends_with_newline_ = false;
+    bool eof_ = false;
+};
 
-inline std::vector<std::string> charList(const std::string &dir, int cutoff = 0, float rate = 1) {
+// The files of dir in the order directory_iterator visits them. Loaders work on the files in
+// parallel and merge their results in this order, so the output does not depend on thread_num.
+inline std::vector<std::string> corpusFiles(const std::string &dir) {
     std::vector<std::string> ret;
-    std::unordered_map<std::string, int> word_stat;
-    int sent_num = 0;
-
     for (const auto &entry : std::filesystem::directory_iterator(dir)) {
-        std::string path = entry.path();
-        std::ifstream ifs(path);
-        std::string raw_line;
+        ret.push_back(entry.path());
+    }
+    return ret;
+}
 
-        while (std::getline(ifs, raw_line)) {
-            ++sent_num;
-            if (sent_num % 100 >= rate * 100) {
-                continue;
-            }
-            utf8_string line(raw_line);
-            for (int i = 0; i < line.length(); ++i) {
-                std::string c = line.substr(i, 1).cpp_str();
-                auto it = word_stat.find(c);
-                if (it == word_stat.end()) {
-                    word_stat.insert(std::make_pair(c, 1));
-                } else {
-                    word_stat.at(c) += 1;
-                }
-            }
+inline void countChars(std::string_view line, std::unordered_map<char32_t, int> &char_stat) {
+    for (size_t offset = 0; offset < line.size();) {
+        char32_t c;
+        offset += decodeUtf8(line.data() + offset, line.size() - offset, c);
+        if (c != INVALID_CODE_POINT) {
+            ++char_stat[c];
         }
-        std::cout << fmt::format("rate:{} size:{}", (float)sent_num / 15462425, word_stat.size())
-            << std::endl;
     }
+}
 
-    for (const auto &it : word_stat) {
+// Keeps the chars seen more than cutoff times, ordered by code point so that the vocabulary does
+// not depend on the order the counts were merged in.
+inline std::vector<std::string> charListFromStat(const std::unordered_map<char32_t, int> &stat,
+        int cutoff) {
+    std::vector<char32_t> chars;
+    for (const auto &it : stat) {
         if (it.second > cutoff) {
-            ret.push_back(it.first);
+            chars.push_back(it.first);
         }
     }
+    std::sort(chars.begin(), chars.end());
+
+    std::vector<std::string> ret;
+    ret.reserve(chars.size() + 3);
+    for (char32_t ch : chars) {
+        std::string c;
+        appendUtf8(ch, c);
+        ret.push_back(move(c));
+    }
     ret.push_back(UNK);
     ret.push_back(WORD_SYMBOL);
     ret.push_back(SEG_SYMBOL);
+    return ret;
+}
+
+inline Dataset readDataset(const std::string &dir_name, const CharVocab &vocab,
+        const std::unordered_map<std::string, int> &class_vocab,
+        float ratio = 1,
+        int thread_num = 1,
+        int id_width = 4) {
+    std::vector<std::string> files = corpusFiles(dir_name);
+    std::vector<Dataset> file_datasets;
+    file_datasets.reserve(files.size());
+    for (int i = 0; i < files.size(); ++i) {
+        file_datasets.emplace_back(id_width);
+    }
+    std::vector<std::string> file_logs(files.size());
+
+    parallelFor(files.size(), thread_num, [&](int file_i) {
+        MappedFile file(files.at(file_i));
+        LineReader reader(file);
+        std::string_view raw_line;
+        int class_id = class_vocab.at(langName(files.at(file_i)));
+        std::vector<int> words;
+
+        int local_sent_num = 0;
+        while (reader.next(raw_line)) {
+            ++local_sent_num;
+            if (local_sent_num % 100 >= ratio * 100) {
+                continue;
+            }
+
+            words.clear();
+            appendWords(raw_line.data(), raw_line.size(), vocab.wordSymbolId(),
+                    [&](char32_t ch) { return vocab.id(ch); }, words);
+            if (local_sent_num % 100000 == 1) {
+                std::string &log = file_logs.at(file_i);
+                log += fmt::format("line:{}\n", raw_line);
+                for (int id : words) {
+                    log += fmt::format("{} ", id);
+                }
+                log += "\n";
+            }
+            file_datasets.at(file_i).push_back(words, class_id);
+        }
+    });
+
+    Dataset ret(id_width);
+    for (int i = 0; i < files.size(); ++i) {
+        std::cout << fmt::format("sent_num:{} rate:{}", ret.size(), ret.size() / 15462425.0f)
+            << std::endl << file_logs.at(i);
+        ret.append(file_datasets.at(i));
+        file_datasets.at(i) = Dataset(id_width);
+    }
 
     return ret;
 }
 
-inline std::vector<std::string> classList(const std::string &dir) {
-    std::set<std::string> class_set;
+// Stand-ins for ids while scanCorpus does not know the vocabulary yet. Chars are kept as their code
+// points, and code points past the Unicode range collapse into PROVISIONAL_UNK.
+inline constexpr int PROVISIONAL_UNK = 0x110000;
+inline constexpr int PROVISIONAL_WORD_SYMBOL = 0x110001;
 
-    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
-        std::string path = entry.path();
-        std::ifstream ifs(path);
-        std::string raw_line;
+struct ScannedCorpus {
+    // The chars seen more than cutoff times with the special symbols after them, as
+    // charListFromStat lists them, and the langs of the files in name order.
+    std::vector<std::string> char_list;
+    std::vector<std::string> class_list;
+    // Tokenized sents holding provisional ids, and indices into class_list as their classes,
+    // until remapCorpus runs.
+    Dataset dataset;
+};
+
+// Lists the chars and classes of dir and tokenizes it as readDataset does, in a single pass over
+// dir. Chars are counted and sents kept for the same sampled lines.
+inline ScannedCorpus scanCorpus(const std::string &dir, int cutoff = 0, float ratio = 1,
+        int thread_num = 1) {
+    std::vector<std::string> files = corpusFiles(dir);
+    std::vector<std::unordered_map<char32_t, int>> file_stats(files.size());
+    std::vector<Dataset> file_datasets(files.size());
 
-        auto lang_name = langName(path);
-        std::cout << "lang:" << lang_name << std::endl;
-        class_set.insert(lang_name);
+    auto provisional_id = [](char32_t ch) {
+        return ch < PROVISIONAL_UNK ? static_cast<int>(ch) : PROVISIONAL_UNK;
+    };
+
+    parallelFor(files.size(), thread_num, [&](int file_i) {
+        MappedFile file(files.at(file_i));
+        LineReader reader(file);
+        std::string_view raw_line;
+        std::unordered_map<char32_t, int> &char_stat = file_stats.at(file_i);
+        std::vector<int> words;
+
+        // Lines are sampled by their number within the file, as readDataset samples them, so that
+        // no file has to be counted before the others are read.
+        int sent_num = 0;
+        while (reader.next(raw_line)) {
+            ++sent_num;
+            if (sent_num % 100 < ratio * 100) {
+                countChars(raw_line, char_stat);
+                words.clear();
+                appendWords(raw_line.data(), raw_line.size(), PROVISIONAL_WORD_SYMBOL,
+                        provisional_id, words);
+                // The class is filled in once class_list is known.
+                file_datasets.at(file_i).push_back(words, file_i);
+            }
+        }
+    });
+
+    ScannedCorpus corpus;
+    std::unordered_map<char32_t, int> char_stat;
+    std::vector<std::string> file_classes;
+    for (int i = 0; i < files.size(); ++i) {
+        std::cout << fmt::format("sent_num:{} rate:{}", corpus.dataset.size(),
+                corpus.dataset.size() / 15462425.0f) << std::endl;
+        file_classes.push_back(langName(files.at(i)));
+        std::cout << "lang:" << file_classes.back() << std::endl;
+        for (const auto &it : file_stats.at(i)) {
+            if (it.first < PROVISIONAL_UNK) {
+                char_stat[it.first] += it.second;
+            }
+        }
+        corpus.dataset.append(file_datasets.at(i));
+        file_datasets.at(i) = Dataset();
     }
 
-    std::vector<std::string> ret;
+    corpus.char_list = charListFromStat(char_stat, cutoff);
+    std::cout << fmt::format("char size:{}", corpus.char_list.size()) << std::endl;
 
-    for (const auto &it : class_set) {
-        ret.push_back(it);
+    std::set<std::string> class_set(file_classes.begin(), file_classes.end());
+    corpus.class_list.assign(class_set.begin(), class_set.end());
+    int *classes = corpus.dataset.mutableClasses();
+    for (size_t i = 0; i < corpus.dataset.size(); ++i) {
+        classes[i] = std::lower_bound(corpus.class_list.begin(), corpus.class_list.end(),
+                file_classes.at(classes[i])) - corpus.class_list.begin();
     }
 
-    return ret;
+    return corpus;
 }
+
+// Rewrites the provisional ids of corpus into ids of vocab and class_vocab in place, and returns
+// the dataset readDataset would with the same id_width.
+inline Dataset remapCorpus(ScannedCorpus &corpus, const CharVocab &vocab,
+        const std::unordered_map<std::string, int> &class_vocab,
+        int id_width = 4) {
+    int *tokens = corpus.dataset.mutableTokens();
+    for (size_t i = 0; i < corpus.dataset.tokenNum(); ++i) {
+        int &id = tokens[i];
+        if (id == PROVISIONAL_WORD_SYMBOL) {
+            id = vocab.wordSymbolId();
+        } else if (id != -1) {
+            id = vocab.id(id);
+        }
+    }
+    int *classes = corpus.dataset.mutableClasses();
+    for (size_t i = 0; i < corpus.dataset.size(); ++i) {
+        classes[i] = class_vocab.at(corpus.class_list.at(classes[i]));
+    }
+    if (id_width == 2) {
+        corpus.dataset.narrow();
+    }
+    return std::move(corpus.dataset);
+}
+
 #endif
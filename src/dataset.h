@@ -0,0 +1,296 @@
+#ifndef LANG_ID_DATASET_H
+#define LANG_ID_DATASET_H
+
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Tokenized sents use -1 to separate words fed to the model char by char. Ids stored in 16 bits
+// have no -1, so this value stands in for it there, and a 16-bit vocabulary must stay below it.
+inline constexpr uint16_t NARROW_SEPARATOR_ID = 0xffff;
+
+// The number of bytes a token id of a vocabulary of vocab_size takes in a Dataset.
+inline int idWidthFor(size_t vocab_size) {
+    return vocab_size <= NARROW_SEPARATOR_ID ? 2 : 4;
+}
+
+// A read-only view of consecutive ids, standing in for const std::vector<int> & wherever a sent
+// may live inside a larger buffer. The ids are stored as int or as 16 bits, and read back as int
+// either way.
+class IdSpan {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = int;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = int;
+
+        Iterator(const IdSpan &span, size_t i) : span_(&span), i_(i) {}
+
+        int operator*() const {
+            return (*span_)[i_];
+        }
+
+        Iterator &operator++() {
+            ++i_;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator ret = *this;
+            ++i_;
+            return ret;
+        }
+
+        bool operator==(const Iterator &other) const {
+            return i_ == other.i_;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return i_ != other.i_;
+        }
+
+    private:
+        const IdSpan *span_;
+        size_t i_;
+    };
+
+    IdSpan() = default;
+
+    IdSpan(const int *data, size_t size) : data_(data), size_(size) {}
+
+    IdSpan(const uint16_t *data, size_t size) : data_(data), size_(size), wide_(false) {}
+
+    IdSpan(const std::vector<int> &ids) : data_(ids.data()), size_(ids.size()) {}
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    int operator[](size_t i) const {
+        if (wide_) {
+            return static_cast<const int *>(data_)[i];
+        }
+        uint16_t id = static_cast<const uint16_t *>(data_)[i];
+        return id == NARROW_SEPARATOR_ID ? -1 : id;
+    }
+
+    int at(size_t i) const {
+        if (i >= size_) {
+            throw std::out_of_range("IdSpan::at");
+        }
+        return (*this)[i];
+    }
+
+    int back() const {
+        return (*this)[size_ - 1];
+    }
+
+    // The len ids from pos on, read in place.
+    IdSpan subspan(size_t pos, size_t len) const {
+        IdSpan ret = *this;
+        size_t id_bytes = wide_ ? sizeof(int) : sizeof(uint16_t);
+        ret.data_ = static_cast<const char *>(data_) + pos * id_bytes;
+        ret.size_ = len;
+        return ret;
+    }
+
+    Iterator begin() const {
+        return Iterator(*this, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(*this, size_);
+    }
+
+    std::vector<int> toVector() const {
+        return std::vector<int>(begin(), end());
+    }
+
+private:
+    const void *data_ = nullptr;
+    size_t size_ = 0;
+    bool wide_ = true;
+};
+
+// Hashes an id sequence, such as a word's char ids, for use as an unordered_map key.
+struct IdsHash {
+    size_t operator()(const std::vector<int> &ids) const {
+        size_t hash = ids.size();
+        for (int id : ids) {
+            hash = hash * 1000003 ^ static_cast<unsigned>(id);
+        }
+        return hash;
+    }
+};
+
+// Sents and their classes stored CSR style: every token in one buffer, and sent i is
+// tokens[offsets[i], offsets[i + 1]). Tokens take id_width bytes each, 4 or 2 as idWidthFor
+// picks. A Dataset either owns its buffers, growing them with push_back, or views buffers kept
+// alive by an owner such as a mapped dataset cache.
+class Dataset {
+public:
+    explicit Dataset(int id_width = 4) : id_width_(id_width) {
+        sync();
+    }
+
+    Dataset(const int64_t *offsets, const void *tokens, int id_width, const int *classes,
+            size_t size,
+            std::shared_ptr<const void> owner) : id_width_(id_width), owner_(std::move(owner)),
+        offsets_(offsets), tokens_(tokens), classes_(classes), size_(size) {}
+
+    // Views point into the buffers, which a copy would not share.
+    Dataset(const Dataset &) = delete;
+    Dataset &operator=(const Dataset &) = delete;
+
+    // Moving a vector keeps its buffer, so the views stay valid.
+    Dataset(Dataset &&) = default;
+    Dataset &operator=(Dataset &&) = default;
+
+    void reserve(size_t sent_num, size_t token_num) {
+        own_offsets_.reserve(sent_num + 1);
+        own_classes_.reserve(sent_num);
+        if (id_width_ == 2) {
+            narrow_tokens_.reserve(token_num);
+        } else {
+            wide_tokens_.reserve(token_num);
+        }
+        sync();
+    }
+
+    void push_back(IdSpan sent, int class_id) {
+        if (id_width_ == 2) {
+            for (int id : sent) {
+                narrow_tokens_.push_back(narrowId(id));
+            }
+            own_offsets_.push_back(narrow_tokens_.size());
+        } else {
+            wide_tokens_.insert(wide_tokens_.end(), sent.begin(), sent.end());
+            own_offsets_.push_back(wide_tokens_.size());
+        }
+        own_classes_.push_back(class_id);
+        sync();
+    }
+
+    void append(const Dataset &other) {
+        reserve(size() + other.size(), tokenNum() + other.tokenNum());
+        for (size_t i = 0; i < other.size(); ++i) {
+            push_back(other.sent(i), other.classId(i));
+        }
+    }
+
+    // Converts the owned int tokens to 16 bits, for a Dataset built before its vocabulary was
+    // known to fit.
+    void narrow() {
+        checkOwned();
+        if (id_width_ == 2) {
+            return;
+        }
+        narrow_tokens_.reserve(wide_tokens_.size());
+        for (int id : wide_tokens_) {
+            narrow_tokens_.push_back(narrowId(id));
+        }
+        wide_tokens_ = std::vector<int>();
+        id_width_ = 2;
+        sync();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t tokenNum() const {
+        return offsets_[size_];
+    }
+
+    int idWidth() const {
+        return id_width_;
+    }
+
+    IdSpan sent(size_t i) const {
+        size_t size = offsets_[i + 1] - offsets_[i];
+        return id_width_ == 2 ?
+            IdSpan(static_cast<const uint16_t *>(tokens_) + offsets_[i], size) :
+            IdSpan(static_cast<const int *>(tokens_) + offsets_[i], size);
+    }
+
+    int classId(size_t i) const {
+        return classes_[i];
+    }
+
+    const int64_t *offsets() const {
+        return offsets_;
+    }
+
+    const void *tokens() const {
+        return tokens_;
+    }
+
+    const int *classes() const {
+        return classes_;
+    }
+
+    // Only a Dataset owning int tokens can have them rewritten in place.
+    int *mutableTokens() {
+        checkOwned();
+        if (id_width_ != 4) {
+            std::cerr << "Dataset holds 16-bit ids" << std::endl;
+            abort();
+        }
+        return wide_tokens_.data();
+    }
+
+    int *mutableClasses() {
+        checkOwned();
+        return own_classes_.data();
+    }
+
+private:
+    static uint16_t narrowId(int id) {
+        if (id == -1) {
+            return NARROW_SEPARATOR_ID;
+        } else if (id < 0 || id >= NARROW_SEPARATOR_ID) {
+            std::cerr << "id does not fit in 16 bits:" << id << std::endl;
+            abort();
+        }
+        return id;
+    }
+
+    void sync() {
+        offsets_ = own_offsets_.data();
+        tokens_ = id_width_ == 2 ? static_cast<const void *>(narrow_tokens_.data()) :
+            wide_tokens_.data();
+        classes_ = own_classes_.data();
+        size_ = own_classes_.size();
+    }
+
+    void checkOwned() const {
+        if (owner_ != nullptr) {
+            std::cerr << "Dataset views a buffer it does not own" << std::endl;
+            abort();
+        }
+    }
+
+    int id_width_;
+    std::vector<int64_t> own_offsets_ = {0};
+    std::vector<int> wide_tokens_;
+    std::vector<uint16_t> narrow_tokens_;
+    std::vector<int> own_classes_;
+    std::shared_ptr<const void> owner_;
+    const int64_t *offsets_;
+    const void *tokens_;
+    const int *classes_;
+    size_t size_;
+};
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef LANG_ID_DATASET_CACHE_H
+#define LANG_ID_DATASET_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "fmt/core.h"
+#include "insnet/insnet.h"
+#include "dataset.h"
+#include "mapped_file.h"
+
+// A tokenized dataset as written by preprocess, laid out so that it can be used straight from a
+// memory mapping:
+//
+//   DatasetCacheHeader
+//   the char list, then the class list, each string as a uint32 length and its bytes
+//   zero padding up to a multiple of 8 bytes
+//   int64 offsets[sent_num + 1], where sent i is tokens[offsets[i], offsets[i + 1])
+//   tokens[token_num], each id_width bytes as in Dataset, zero padded to a multiple of 4 bytes
+//   int32 classes[sent_num]
+//
+// The header holds a hash of the vocabularies the ids refer to, so that readers can tell a cache
+// made with another vocabulary from a usable one.
+
+inline constexpr char DATASET_CACHE_MAGIC[8] = {'L', 'I', 'D', 'C', 'A', 'C', 'H', 'E'};
+inline constexpr uint32_t DATASET_CACHE_VERSION = 2;
+
+struct DatasetCacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t cutoff;
+    float ratio;
+    uint32_t id_width;
+    uint64_t vocab_hash;
+    uint64_t char_num;
+    uint64_t class_num;
+    uint64_t list_bytes;
+    uint64_t sent_num;
+    uint64_t token_num;
+};
+
+static_assert(sizeof(DatasetCacheHeader) % 8 == 0, "sections after the header must stay aligned");
+
+// The zero bytes after token_bytes of tokens that keep the classes 4-byte aligned.
+inline size_t tokenPadding(size_t token_bytes) {
+    return (4 - token_bytes % 4) % 4;
+}
+
+// The strings of vocab in id order.
+inline std::vector<std::string> vocabList(const insnet::Vocab &vocab) {
+    std::vector<std::string> ret;
+    ret.reserve(vocab.size());
+    for (int i = 0; i < vocab.size(); ++i) {
+        ret.push_back(vocab.from_id(i));
+    }
+    return ret;
+}
+
+// FNV-1a over both lists in id order, so that two vocabularies hash alike only if they give every
+// string the same id.
+inline uint64_t vocabHash(const std::vector<std::string> &char_list,
+        const std::vector<std::string> &class_list) {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const void *data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<const unsigned char *>(data)[i]) * 1099511628211ull;
+        }
+    };
+    for (const auto *list : {&char_list, &class_list}) {
+        uint64_t list_size = list->size();
+        add(&list_size, sizeof(list_size));
+        for (const std::string &str : *list) {
+            uint32_t str_size = str.size();
+            add(&str_size, sizeof(str_size));
+            add(str.data(), str.size());
+        }
+    }
+    return hash;
+}
+
+inline void writeDatasetCache(const std::string &path, const std::vector<std::string> &char_list,
+        const std::vector<std::string> &class_list,
+        int cutoff,
+        float ratio,
+        const Dataset &dataset) {
+    std::string lists;
+    for (const auto *list : {&char_list, &class_list}) {
+        for (const std::string &str : *list) {
+            uint32_t str_size = str.size();
+            lists.append(reinterpret_cast<const char *>(&str_size), sizeof(str_size));
+            lists += str;
+        }
+    }
+    lists.resize((lists.size() + 7) / 8 * 8, '\0');
+
+    DatasetCacheHeader header = {};
+    std::memcpy(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DATASET_CACHE_VERSION;
+    header.cutoff = cutoff;
+    header.ratio = ratio;
+    header.id_width = dataset.idWidth();
+    header.vocab_hash = vocabHash(char_list, class_list);
+    header.char_num = char_list.size();
+    header.class_num = class_list.size();
+    header.list_bytes = lists.size();
+    header.sent_num = dataset.size();
+    header.token_num = dataset.tokenNum();
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(lists.data(), lists.size());
+    static_assert(sizeof(int) == sizeof(int32_t), "arrays are written as they are in memory");
+    out.write(reinterpret_cast<const char *>(dataset.offsets()),
+            (dataset.size() + 1) * sizeof(int64_t));
+    size_t token_bytes = dataset.tokenNum() * dataset.idWidth();
+    out.write(static_cast<const char *>(dataset.tokens()), token_bytes);
+    out.write("\0\0\0", tokenPadding(token_bytes));
+    out.write(reinterpret_cast<const char *>(dataset.classes()), dataset.size() * sizeof(int32_t));
+    if (!out) {
+        std::cerr << fmt::format("write {} fail", path) << std::endl;
+        abort();
+    }
+}
+
+// A dataset cache mapped into memory. Only the two string lists are decoded on open; the arrays
+// are read in place through mappedDataset, after their offsets, token ids and classes are checked.
+//
+// A cache written in another format version is not read at all: compatible() is false and
+// nothing but version() may be asked of it, so that callers can fall back on the text dir as they
+// do for a cache made with another vocabulary. A cache that is corrupt aborts.
+class DatasetCache {
+public:
+    // Training visits the sents in a shuffled order again every epoch, so the whole file is asked
+    // for up front rather than read ahead sequentially.
+    explicit DatasetCache(const std::string &path) : file_(path, MADV_WILLNEED) {
+        std::string_view content = file_.content();
+        if (content.size() < sizeof(DatasetCacheHeader) ||
+                std::memcmp(content.data(), DATASET_CACHE_MAGIC, sizeof(DATASET_CACHE_MAGIC))) {
+            std::cerr << fmt::format("{} is not a dataset cache", path) << std::endl;
+            abort();
+        }
+        header_ = reinterpret_cast<const DatasetCacheHeader *>(content.data());
+        if (header_->version != DATASET_CACHE_VERSION) {
+            return;
+        }
+        auto corrupt = [&](const std::string &what) {
+            std::cerr << fmt::format("dataset cache {} is corrupt: {}", path, what) << std::endl;
+            abort();
+        };
+        if (header_->id_width != 2 && header_->id_width != 4) {
+            corrupt(fmt::format("id width {}", header_->id_width));
+        }
+        if (header_->list_bytes % 8 != 0) {
+            corrupt(fmt::format("list bytes {} leave the arrays unaligned", header_->list_bytes));
+        }
+        size_t token_bytes = header_->token_num * header_->id_width;
+        size_t expected_size = sizeof(DatasetCacheHeader) + header_->list_bytes +
+            (header_->sent_num + 1) * sizeof(int64_t) + token_bytes + tokenPadding(token_bytes) +
+            header_->sent_num * sizeof(int32_t);
+        if (content.size() != expected_size) {
+            std::cerr << fmt::format("dataset cache {} is truncated", path) << std::endl;
+            abort();
+        }
+
+        const char *lists = content.data() + sizeof(DatasetCacheHeader);
+        size_t pos = 0;
+        for (auto [list, num] : {std::make_pair(&char_list_, header_->char_num),
+                std::make_pair(&class_list_, header_->class_num)}) {
+            if (num > header_->list_bytes / sizeof(uint32_t)) {
+                corrupt(fmt::format("{} strings in {} list bytes", num, header_->list_bytes));
+            }
+            list->reserve(num);
+            for (uint64_t i = 0; i < num; ++i) {
+                uint32_t str_size;
+                if (header_->list_bytes - pos < sizeof(str_size)) {
+                    corrupt("the lists overrun their bytes");
+                }
+                std::memcpy(&str_size, lists + pos, sizeof(str_size));
+                pos += sizeof(str_size);
+                if (header_->list_bytes - pos < str_size) {
+                    corrupt("the lists overrun their bytes");
+                }
+                list->emplace_back(lists + pos, str_size);
+                pos += str_size;
+            }
+        }
+        offsets_ = reinterpret_cast<const int64_t *>(lists + header_->list_bytes);
+        tokens_ = offsets_ + header_->sent_num + 1;
+        classes_ = reinterpret_cast<const int32_t *>(static_cast<const char *>(tokens_) +
+                token_bytes + tokenPadding(token_bytes));
+
+        if (offsets_[0] != 0 || offsets_[header_->sent_num] != header_->token_num) {
+            corrupt(fmt::format("offsets span [{}, {}) rather than the {} tokens", offsets_[0],
+                        offsets_[header_->sent_num], header_->token_num));
+        }
+        for (uint64_t i = 0; i < header_->sent_num; ++i) {
+            if (offsets_[i] > offsets_[i + 1]) {
+                corrupt(fmt::format("offset {} decreases", i + 1));
+            }
+            if (classes_[i] < 0 || classes_[i] >= header_->class_num) {
+                corrupt(fmt::format("sent {} has class {} of {}", i, classes_[i],
+                            header_->class_num));
+            }
+        }
+        // Ids go straight into the embedding during training, so each must be a char of the list
+        // or the separator.
+        auto check_tokens = [&](const auto *tokens, int64_t separator_id) {
+            for (uint64_t i = 0; i < header_->token_num; ++i) {
+                int64_t id = tokens[i];
+                if (id != separator_id && (id < 0 || id >= header_->char_num)) {
+                    corrupt(fmt::format("token {} has id {} of {} chars", i, id,
+                                header_->char_num));
+                }
+            }
+        };
+        if (header_->id_width == 2) {
+            check_tokens(static_cast<const uint16_t *>(tokens_), NARROW_SEPARATOR_ID);
+        } else {
+            check_tokens(static_cast<const int32_t *>(tokens_), -1);
+        }
+    }
+
+    bool compatible() const {
+        return header_->version == DATASET_CACHE_VERSION;
+    }
+
+    uint32_t version() const {
+        return header_->version;
+    }
+
+    const std::vector<std::string> &charList() const {
+        return char_list_;
+    }
+
+    const std::vector<std::string> &classList() const {
+        return class_list_;
+    }
+
+    int cutoff() const {
+        return header_->cutoff;
+    }
+
+    float ratio() const {
+        return header_->ratio;
+    }
+
+    uint64_t vocabHash() const {
+        return header_->vocab_hash;
+    }
+
+    size_t size() const {
+        return header_->sent_num;
+    }
+
+    const int64_t *offsets() const {
+        return offsets_;
+    }
+
+    int idWidth() const {
+        return header_->id_width;
+    }
+
+    const void *tokens() const {
+        return tokens_;
+    }
+
+    const int32_t *classes() const {
+        return classes_;
+    }
+
+private:
+    MappedFile file_;
+    const DatasetCacheHeader *header_;
+    std::vector<std::string> char_list_;
+    std::vector<std::string> class_list_;
+    const int64_t *offsets_;
+    const void *tokens_;
+    const int32_t *classes_;
+};
+
+// A Dataset reading the arrays of cache in place, which keeps cache mapped for as long as it lives.
+inline Dataset mappedDataset(const std::shared_ptr<const DatasetCache> &cache) {
+    return Dataset(cache->offsets(), cache->tokens(), cache->idWidth(), cache->classes(),
+            cache->size(), cache);
+}
+
+#endif
@@ -5,4 +5,8 @@ inline const char *WORD_SYMBOL = "<WORD>";
 inline const char *SEG_SYMBOL = "<SEG>";
 inline const char *UNK = "<UNK>";
 
+// The most ids a word may have, its <WORD> symbol included. The tokenizer feeds longer words to
+// the model char by char.
+inline constexpr int MAX_WORD_LEN = 32;
+
 #endif
@@ -0,0 +1,198 @@
+#ifndef LANG_ID_JSON_UTIL_H
+#define LANG_ID_JSON_UTIL_H
+
+#include <string>
+#include "char_vocab.h"
+
+// Just enough JSON to read one string field from a JSONL record and to write results back.
+
+inline void skipJsonSpace(const std::string &json, size_t &pos) {
+    while (pos < json.size() && (json.at(pos) == ' ' || json.at(pos) == '\t' ||
+                json.at(pos) == '\r' || json.at(pos) == '\n')) {
+        ++pos;
+    }
+}
+
+inline bool parseHex4(const std::string &json, size_t pos, char32_t &value) {
+    if (pos + 4 > json.size()) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = pos; i < pos + 4; ++i) {
+        char c = json.at(i);
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+            c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return false;
+        }
+        value = value << 4 | digit;
+    }
+    return true;
+}
+
+// Parses the string literal starting at pos and leaves pos after its closing quote.
+inline bool parseJsonString(const std::string &json, size_t &pos, std::string &value) {
+    if (pos >= json.size() || json.at(pos) != '"') {
+        return false;
+    }
+    value.clear();
+    for (++pos; pos < json.size(); ++pos) {
+        char c = json.at(pos);
+        if (c == '"') {
+            ++pos;
+            return true;
+        } else if (c != '\\') {
+            value.push_back(c);
+            continue;
+        }
+        if (++pos == json.size()) {
+            return false;
+        }
+        switch (json.at(pos)) {
+            case '"': value.push_back('"'); break;
+            case '\\': value.push_back('\\'); break;
+            case '/': value.push_back('/'); break;
+            case 'b': value.push_back('\b'); break;
+            case 'f': value.push_back('\f'); break;
+            case 'n': value.push_back('\n'); break;
+            case 'r': value.push_back('\r'); break;
+            case 't': value.push_back('\t'); break;
+            case 'u': {
+                char32_t cp;
+                if (!parseHex4(json, pos + 1, cp)) {
+                    return false;
+                }
+                pos += 4;
+                char32_t low;
+                if (cp >= 0xd800 && cp < 0xdc00 && pos + 2 < json.size() &&
+                        json.at(pos + 1) == '\\' && json.at(pos + 2) == 'u' &&
+                        parseHex4(json, pos + 3, low) && low >= 0xdc00 && low < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    pos += 6;
+                }
+                appendUtf8(cp, value);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+// Skips the value starting at pos, whatever its type.
+inline bool skipJsonValue(const std::string &json, size_t &pos) {
+    if (pos >= json.size()) {
+        return false;
+    }
+    char c = json.at(pos);
+    if (c == '"') {
+        std::string ignored;
+        return parseJsonString(json, pos, ignored);
+    } else if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        ++pos;
+        skipJsonSpace(json, pos);
+        if (pos < json.size() && json.at(pos) == close) {
+            ++pos;
+            return true;
+        }
+        while (true) {
+            if (c == '{') {
+                std::string ignored;
+                if (!parseJsonString(json, pos, ignored)) {
+                    return false;
+                }
+                skipJsonSpace(json, pos);
+                if (pos >= json.size() || json.at(pos++) != ':') {
+                    return false;
+                }
+                skipJsonSpace(json, pos);
+            }
+            if (!skipJsonValue(json, pos)) {
+                return false;
+            }
+            skipJsonSpace(json, pos);
+            if (pos >= json.size()) {
+                return false;
+            }
+            char next = json.at(pos++);
+            if (next == close) {
+                return true;
+            } else if (next != ',') {
+                return false;
+            }
+            skipJsonSpace(json, pos);
+        }
+    } else {
+        size_t begin = pos;
+        while (pos < json.size() && json.at(pos) != ',' && json.at(pos) != '}' &&
+                json.at(pos) != ']' && json.at(pos) != ' ' && json.at(pos) != '\t' &&
+                json.at(pos) != '\r' && json.at(pos) != '\n') {
+            ++pos;
+        }
+        return pos > begin;
+    }
+}
+
+// Reads the string field named field from the top level of the JSON object in json.
+inline bool jsonStringField(const std::string &json, const std::string &field,
+        std::string &value) {
+    size_t pos = 0;
+    skipJsonSpace(json, pos);
+    if (pos >= json.size() || json.at(pos++) != '{') {
+        return false;
+    }
+    skipJsonSpace(json, pos);
+    if (pos < json.size() && json.at(pos) == '}') {
+        return false;
+    }
+    std::string key;
+    while (true) {
+        if (!parseJsonString(json, pos, key)) {
+            return false;
+        }
+        skipJsonSpace(json, pos);
+        if (pos >= json.size() || json.at(pos++) != ':') {
+            return false;
+        }
+        skipJsonSpace(json, pos);
+        if (key == field) {
+            return parseJsonString(json, pos, value);
+        }
+        if (!skipJsonValue(json, pos)) {
+            return false;
+        }
+        skipJsonSpace(json, pos);
+        if (pos >= json.size() || json.at(pos++) != ',') {
+            return false;
+        }
+        skipJsonSpace(json, pos);
+    }
+}
+
+inline std::string escapeJson(const std::string &str) {
+    std::string ret;
+    ret.reserve(str.size() + 2);
+    for (char c : str) {
+        switch (c) {
+            case '"': ret += "\\\""; break;
+            case '\\': ret += "\\\\"; break;
+            case '\n': ret += "\\n"; break;
+            case '\r': ret += "\\r"; break;
+            case '\t': ret += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    const char *hex = "0123456789abcdef";
+                    ret += "\\u00";
+                    ret.push_back(hex[c >> 4]);
+                    ret.push_back(hex[c & 0xf]);
+                } else {
+                    ret.push_back(c);
+                }
+        }
+    }
+    return ret;
+}
+
+#endif
@@ -23,6 +23,9 @@
 #include "model/model.h"
 #include <iomanip>
 #include "common.h"
+#include "worker_pool.h"
+#include "dataset_cache.h"
+#include "batch_sampler.h"
 
 using cxxopts::Options;
 using std::string;
@@ -69,10 +72,6 @@ unordered_map<string, int> calWordFreq(const vector<vector<string>> &sentences)
     return ret;
 }
 
-float F1(float correct, float predicted, float golden) {
-    return 2 * correct / (predicted + golden + 1e-10);
-}
-
 string saveModel(ModelParams &model_params, Vocab &vocab, Vocab &class_vocab,
         const string &filename_prefix, int iter,
         int dim,
@@ -99,44 +98,32 @@ string saveModel(ModelParams &model_params, Vocab &vocab, Vocab &class_vocab,
     return filename;
 }
 
-float evaluate(ModelParams &params, dtype dropout, const string &dir, Vocab &vocab,
+float evaluate(ModelParams &params, dtype dropout,
+        const Dataset &dataset,
+        const BatchSampler &sampler,
+        Vocab &vocab,
         Vocab &class_vocab,
         int seg_len,
-        int batch_size = 1,
-        float ratio = 1) {
-    auto dataset = readDataset(dir, vocab.m_string_to_id, class_vocab.m_string_to_id, ratio);
-    vector<int> ids;
-    for (int i = 0; i < dataset.first.size(); ++i) {
-        ids.push_back(i);
-    }
-    auto batch_begin = ids.begin();
+        const BatchBudget &budget,
+        int thread_num = 1) {
+    // The stats count over the whole process, so this evaluation's share is what they gain.
+    const WordEncStats &word_enc_stats = wordEncStats();
+    int64_t lookup_num_before = word_enc_stats.lookup_num;
+    int64_t hit_num_before = word_enc_stats.hit_num;
     int word_symbol_id = vocab.from_string(WORD_SYMBOL);
     int seg_symbol_id = vocab.from_string(SEG_SYMBOL);
-    vector<float> correct_times;
-    vector<float> predicted_times;
-    vector<float> golden_times;
+    ClassScores scores(class_vocab.size());
     float correct_time = 0;
     float total_time = 0;
     cout << "class_vocab size:" << class_vocab.size() << endl;
-    for (int i = 0; i < class_vocab.size(); ++i) {
-        correct_times.push_back(0);
-        predicted_times.push_back(0);
-        golden_times.push_back(0);
-    }
 
-    float sentence_size_sum = 0;
-    default_random_engine engine(0);
-    shuffle(ids.begin(), ids.end(), engine);
-    
-    int iteration = -1;
+    // Batches are planned up front so that they can be run on several threads.
+    vector<vector<int>> batches = sampler.batches(budget, 0);
 
-    while (batch_begin != ids.end()) {
-        ++iteration;
-        auto batch_it = batch_begin;
-        int seg_sum = 0;
+    // The predicted class of every segment of every sent, indexed like batches.
+    vector<vector<vector<int>>> predicted_ids(batches.size());
+    parallelFor(batches.size(), thread_num, [&](int batch_i) {
         Graph graph(insnet::ModelStage::INFERENCE, false);
-        vector<vector<int>> answers;
-
         vector<insnet::LSTMState> initial_states;
         initial_states.reserve(params.sent_enc.size());
         Node *zero = insnet::tensor(graph, params.word_enc.hiddenDim(), 0);
@@ -144,76 +131,94 @@ float evaluate(ModelParams &params, dtype dropout, const string &dir, Vocab &voc
             initial_states.push_back({zero, zero});
         }
 
-        int sentence_size = 0;
         vector<Node *> log_probs;
-        vector<int> *batch_ids;
-        while (seg_sum < batch_size * 0.5 && batch_it != ids.end()) {
-            batch_ids = &dataset.first.at(*batch_it);
-            Node *node = sentEnc(*batch_ids, seg_len, seg_symbol_id, graph, params, dropout,
-                    initial_states);
+        WordEncDedup dedup;
+        for (int sent_i : batches.at(batch_i)) {
+            Node *node = sentEnc(dataset.sent(sent_i), seg_len, seg_symbol_id, graph, params,
+                    dropout, initial_states, &dedup);
             log_probs.push_back(node);
-
-            int answer = dataset.second.at(*batch_it);
-            vector<int> ans;
-            int seg_num = node->size() / class_vocab.size();
-            seg_sum += seg_num;
-            for (int i = 0; i < seg_num; ++i) {
-                ans.push_back(answer);
-            }
-            answers.push_back(move(ans));
-
-            ++batch_it;
-            ++sentence_size;
         }
-        sentence_size_sum += sentence_size;
 
         graph.forward();
-        auto predicted_ids = insnet::argmax(log_probs, class_vocab.size());
-        for (int i = 0; i < predicted_ids.size(); ++i) {
-            if (predicted_ids.at(i).back() == answers.at(i).back()) {
-                correct_times.at(predicted_ids.at(i).back())++;
+        predicted_ids.at(batch_i) = insnet::argmax(log_probs, class_vocab.size());
+    });
+
+    for (int iteration = 0; iteration < batches.size(); ++iteration) {
+        const vector<int> &batch = batches.at(iteration);
+        for (int i = 0; i < batch.size(); ++i) {
+            int predicted = predicted_ids.at(iteration).at(i).back();
+            int answer = dataset.classId(batch.at(i));
+            scores.add(predicted, answer);
+            if (predicted == answer) {
                 correct_time++;
             }
-            predicted_times.at(predicted_ids.at(i).back())++;
-            int answer = answers.at(i).back();
-            golden_times.at(answer)++;
             total_time++;
         }
 
-        batch_begin = batch_it;
-
         if (iteration % 10 == 0) {
-            float sum = 0;
-            for (int i = 0; i < correct_times.size(); ++i) {
-                float f = F1(correct_times.at(i), predicted_times.at(i), golden_times.at(i));
-                sum += f;
-            }
-            cout << "macro f1:" << sum / correct_times.size() << endl;
-            cout << "gold:" << class_vocab.from_id(answers.back().back()) << endl;
-            for (int i = 0; i < batch_ids->size(); ++i) {
-                if (batch_ids->at(i) == word_symbol_id) {
+            cout << "macro f1:" << scores.macroF1() << endl;
+            IdSpan batch_ids = dataset.sent(batch.back());
+            cout << "gold:" << class_vocab.from_id(dataset.classId(batch.back())) << endl;
+            for (int i = 0; i < batch_ids.size(); ++i) {
+                if (batch_ids.at(i) == word_symbol_id) {
                     cout << " ";
                 } else {
-                    if (batch_ids->at(i) >= 0) cout << vocab.from_id(batch_ids->at(i));
+                    if (batch_ids.at(i) >= 0) cout << vocab.from_id(batch_ids.at(i));
                 }
             }
             cout << endl;
             cout << "evaluate predicted: ";
-            for (int id : predicted_ids.back()) {
+            for (int id : predicted_ids.at(iteration).back()) {
                 cout << class_vocab.from_id(id) << " ";
             }
             cout << endl;
         }
     }
 
-    float sum = 0;
-    for (int i = 0; i < correct_times.size(); ++i) {
-        float f = F1(correct_times.at(i), predicted_times.at(i), golden_times.at(i));
-        cout << class_vocab.from_id(i) << ":" << f << endl;
-        sum += f;
+    for (int i = 0; i < scores.classNum(); ++i) {
+        cout << class_vocab.from_id(i) << ":" << scores.f1(i) << endl;
     }
+    int64_t lookup_num = word_enc_stats.lookup_num - lookup_num_before;
+    int64_t hit_num = word_enc_stats.hit_num - hit_num_before;
+    cout << fmt::format("word encoding dedup hit rate:{}",
+            lookup_num == 0 ? 0 : static_cast<float>(hit_num) / lookup_num) << endl;
 
-    return sum / correct_times.size();
+    return scores.macroF1();
+}
+
+// The dataset cache at path, or null if path is empty.
+std::shared_ptr<const DatasetCache> openDatasetCache(const string &path) {
+    return path.empty() ? nullptr : std::make_shared<const DatasetCache>(path);
+}
+
+// Reads the dataset from cache, opened from cache_path, when the cache was made with the vocabs in
+// use and the same ratio in the format version this build reads, and tokenizes dir otherwise.
+Dataset loadDataset(const string &dir, const string &cache_path,
+        const std::shared_ptr<const DatasetCache> &cache,
+        const CharVocab &char_vocab,
+        Vocab &class_vocab,
+        uint64_t vocab_hash,
+        float ratio,
+        int thread_num,
+        int id_width) {
+    if (cache != nullptr) {
+        if (!cache->compatible()) {
+            cout << fmt::format("dataset cache {} rejected: version {} but {} is expected",
+                    cache_path, cache->version(), DATASET_CACHE_VERSION) << endl;
+        } else if (cache->vocabHash() == vocab_hash && cache->ratio() == ratio) {
+            cout << fmt::format("dataset cache {} mapped", cache_path) << endl;
+            return mappedDataset(cache);
+        } else {
+            cout << fmt::format("dataset cache {} rejected: made with another vocab or ratio",
+                    cache_path) << endl;
+        }
+    }
+    if (dir.empty()) {
+        cerr << "no dataset dir to fall back on" << endl;
+        abort();
+    }
+    return readDataset(dir, char_vocab, class_vocab.m_string_to_id, ratio, thread_num,
+            id_width);
 }
 
 int main(int argc, const char *argv[]) {
@@ -221,8 +226,12 @@ int main(int argc, const char *argv[]) {
     options.add_options()
         ("device_id", "device id", cxxopts::value<int>()->default_value("0"))
         ("model", "load model", cxxopts::value<string>()->default_value(""))
-        ("train", "training set dir", cxxopts::value<string>())
-        ("dev", "dev set dir", cxxopts::value<string>())
+        ("train", "training set dir", cxxopts::value<string>()->default_value(""))
+        ("dev", "dev set dir", cxxopts::value<string>()->default_value(""))
+        ("train_cache", "training set cache written by preprocess",
+         cxxopts::value<string>()->default_value(""))
+        ("dev_cache", "dev set cache written by preprocess",
+         cxxopts::value<string>()->default_value(""))
         ("batch_size", "batch size", cxxopts::value<int>()->default_value("1"))
         ("dropout", "dropout", cxxopts::value<float>()->default_value("0.1"))
         ("lr", "learning rate", cxxopts::value<float>()->default_value("0.001"))
@@ -235,7 +244,14 @@ int main(int argc, const char *argv[]) {
         ("seg_len", "segment length", cxxopts::value<int>()->default_value("512"))
         ("dim", "hidden dim", cxxopts::value<int>()->default_value("512"))
         ("save_iter", "save iter", cxxopts::value<int>()->default_value("100000"))
-        ("cutoff", "cutoff", cxxopts::value<int>()->default_value("0"));
+        ("cutoff", "cutoff", cxxopts::value<int>()->default_value("0"))
+        ("threads", "corpus loading and evaluation threads",
+         cxxopts::value<int>()->default_value("1"))
+        ("batch_cost", "cap batches by estimated transformer multiply-adds, in billions, instead "
+         "of by batch_size segments", cxxopts::value<float>()->default_value("0"))
+        ("bucket", "batch sents of similar segment count and length together",
+         cxxopts::value<bool>()->default_value("true"))
+        ("seed", "seed of the batch shuffle", cxxopts::value<int>()->default_value("0"));
 
     auto args = options.parse(argc, argv);
 
@@ -249,24 +265,39 @@ int main(int argc, const char *argv[]) {
     string train_dir = args["train"].as<string>();
     string dev_dir = args["dev"].as<string>();
 
+    string train_cache_path = args["train_cache"].as<string>();
+    string dev_cache_path = args["dev_cache"].as<string>();
+
     float ratio = args["ratio"].as<float>();
-    auto char_list = charList(train_dir, args["cutoff"].as<int>(), ratio);
+    int cutoff = args["cutoff"].as<int>();
+    int thread_num = args["threads"].as<int>();
+    ScannedCorpus train_corpus;
     Vocab vocab;
-    vocab.init(char_list);
-    cout << "vocab size:" << vocab.size() << endl;
     Vocab class_vocab;
-    auto class_list = classList(train_dir);
-    class_vocab.init(class_list);
-    cout << "class size:" << class_vocab.size() << endl;
-
-    auto train_set = readDataset(train_dir, vocab.m_string_to_id, class_vocab.m_string_to_id,
-            ratio);
-
-    if (train_set.first.size() != train_set.second.size()) {
-        abort();
+    // Kept open for loadDataset, so that the cache is mapped once.
+    std::shared_ptr<const DatasetCache> train_cache = openDatasetCache(train_cache_path);
+    if (train_cache != nullptr) {
+        if (!train_cache->compatible()) {
+            cout << fmt::format("dataset cache {} rejected: version {} but {} is expected",
+                    train_cache_path, train_cache->version(), DATASET_CACHE_VERSION) << endl;
+            train_cache.reset();
+        } else if (train_cache->cutoff() == cutoff && train_cache->ratio() == ratio) {
+            vocab.init(train_cache->charList());
+            class_vocab.init(train_cache->classList());
+        } else {
+            cout << fmt::format("dataset cache {} rejected: made with another cutoff or ratio",
+                    train_cache_path) << endl;
+            train_cache.reset();
+        }
     }
+    if (train_cache == nullptr) {
+        train_corpus = scanCorpus(train_dir, cutoff, ratio, thread_num);
+        vocab.init(train_corpus.char_list);
+        class_vocab.init(train_corpus.class_list);
+    }
+    cout << "vocab size:" << vocab.size() << endl;
+    cout << "class size:" << class_vocab.size() << endl;
 
-    cout << "train size:" << train_set.first.size() << endl;
     ModelParams params;
     int dim = args["dim"].as<int>();
     cout << "dim:" << dim << endl;
@@ -293,6 +324,21 @@ int main(int argc, const char *argv[]) {
                 seg_layer, seg_head, sent_layer);
     }
 
+    // Ids are assigned only now, so that a loaded model's vocab is the one used.
+    CharVocab char_vocab(vocab.m_string_to_id);
+    uint64_t vocab_hash = vocabHash(vocabList(vocab), vocabList(class_vocab));
+    int id_width = idWidthFor(vocab.size());
+    cout << "id width:" << id_width << endl;
+    Dataset train_set = train_cache == nullptr ?
+        remapCorpus(train_corpus, char_vocab, class_vocab.m_string_to_id, id_width) :
+        loadDataset(train_dir, train_cache_path, train_cache, char_vocab, class_vocab,
+                vocab_hash, ratio, thread_num, id_width);
+    train_cache.reset();
+    cout << "train size:" << train_set.size() << endl;
+    Dataset dev_set = loadDataset(dev_dir, dev_cache_path, openDatasetCache(dev_cache_path),
+            char_vocab, class_vocab, vocab_hash, ratio, thread_num, id_width);
+    cout << "dev size:" << dev_set.size() << endl;
+
     dtype lr = args["lr"].as<dtype>();
     cout << fmt::format("lr:{}", lr) << endl;
     insnet::AdamOptimizer optimizer(params.tunableParams(), lr);
@@ -303,20 +349,34 @@ int main(int argc, const char *argv[]) {
     int seg_len = args["seg_len"].as<int>();
     cout << fmt::format("seg_len:{}", seg_len) << endl;
 
-    vector<int> train_ids;
-    for (int i = 0; i < train_set.first.size(); ++i) {
-        train_ids.push_back(i);
-    }
+    bool bucket = args["bucket"].as<bool>();
+    unsigned seed = args["seed"].as<int>();
+    cout << fmt::format("bucket:{} seed:{}", bucket, seed) << endl;
+    int word_symbol_id = vocab.from_string(WORD_SYMBOL);
+    EncoderCost cost = {dim, word_layer, seg_layer};
+    BatchSampler train_sampler(train_set, seg_len, word_symbol_id, cost, bucket, thread_num);
+    BatchSampler dev_sampler(dev_set, seg_len, word_symbol_id, cost, bucket, thread_num);
+    cout << fmt::format("train buckets:{} dev buckets:{}", train_sampler.bucketNum(),
+            dev_sampler.bucketNum()) << endl;
 
     float last_f1 = -1;
 
     for (int epoch = 0; ; ++epoch) {
-        default_random_engine engine(0);
-        shuffle(train_ids.begin(), train_ids.end(), engine);
-
-        auto batch_begin = train_ids.begin();
         int batch_size = args["batch_size"].as<int>();
         cout << "batch_size:" << batch_size << endl;
+        float batch_cost = args["batch_cost"].as<float>();
+        cout << "batch_cost:" << batch_cost << endl;
+        // A cost budget replaces the segment budget. Evaluation takes half of either per batch.
+        BatchBudget train_budget;
+        BatchBudget dev_budget;
+        if (batch_cost > 0) {
+            train_budget.max_cost = batch_cost * 1e9;
+            dev_budget.max_cost = batch_cost * 0.5e9;
+        } else {
+            train_budget.max_seg_num = batch_size;
+            dev_budget.max_seg_num = (batch_size + 1) / 2;
+        }
+        vector<vector<int>> batches = train_sampler.batches(train_budget, seed);
         dtype dropout = args["dropout"].as<dtype>();
         int seg_symbol_id = vocab.from_string(SEG_SYMBOL);
         vector<float> correct_times;
@@ -332,10 +392,8 @@ int main(int argc, const char *argv[]) {
 
         float sentence_size_sum = 0;
 
-        while (batch_begin != train_ids.end()) {
+        for (int batch_i = 0; batch_i < batches.size(); ++batch_i) {
             ++iteration;
-            auto batch_it = batch_begin;
-            int seg_sum = 0;
             Graph graph(insnet::ModelStage::TRAINING, false);
             vector<vector<int>> answers;
 
@@ -348,23 +406,21 @@ int main(int argc, const char *argv[]) {
 
             int sentence_size = 0;
             vector<Node *> log_probs;
-            vector<int> *batch_ids;
-            while (seg_sum < batch_size && batch_it != train_ids.end()) {
-                batch_ids = &train_set.first.at(*batch_it);
-                Node *node = sentEnc(*batch_ids, seg_len, seg_symbol_id, graph, params, dropout,
+            IdSpan batch_ids;
+            for (int sent_i : batches.at(batch_i)) {
+                batch_ids = train_set.sent(sent_i);
+                Node *node = sentEnc(batch_ids, seg_len, seg_symbol_id, graph, params, dropout,
                         initial_states);
                 log_probs.push_back(node);
 
-                int answer = train_set.second.at(*batch_it);
+                int answer = train_set.classId(sent_i);
                 vector<int> ans;
                 int seg_num = node->size() / class_vocab.size();
-                seg_sum += seg_num;
                 for (int i = 0; i < seg_num; ++i) {
                     ans.push_back(answer);
                 }
                 answers.push_back(move(ans));
 
-                ++batch_it;
                 ++sentence_size;
             }
             sentence_size_sum += sentence_size;
@@ -389,10 +445,12 @@ int main(int argc, const char *argv[]) {
                     sum += f1;
                 }
                 cout << fmt::format("process:{} loss:{} sentence number:{} macro F:{} acc:{}",
-                        sentence_size_sum / train_ids.size(), loss,
+                        sentence_size_sum / train_set.size(), loss,
                         sentence_size, sum / class_vocab.size(), correct_time / total_time) << endl;
+                cout << fmt::format("estimated cost:{}G",
+                        train_sampler.batchCost(batches.at(batch_i)) * 1e-9) << endl;
                 cout << "gold:" << class_vocab.from_id(answers.back().back()) << endl;
-                print(*batch_ids, vocab);
+                print(batch_ids, vocab);
                 for (int id : predicted_ids.back()) {
                     cout << class_vocab.from_id(id) << " ";
                 }
@@ -401,13 +459,12 @@ int main(int argc, const char *argv[]) {
             graph.backward();
             optimizer.step();
 
-            batch_begin = batch_it;
-
-            if (iteration % save_iter == save_iter - 1 || batch_begin == train_ids.end()) {
-                float macro_f1 = evaluate(params, dropout, dev_dir, vocab, class_vocab, seg_len,
-                        batch_size, ratio);
+            bool epoch_end = batch_i == batches.size() - 1;
+            if (iteration % save_iter == save_iter - 1 || epoch_end) {
+                float macro_f1 = evaluate(params, dropout, dev_set, dev_sampler, vocab,
+                        class_vocab, seg_len, dev_budget, thread_num);
                 cout << fmt::format("f1:{} last:{}", macro_f1, last_f1) << endl;
-                if (batch_begin == train_ids.end()) {
+                if (epoch_end) {
                     if (last_f1 > macro_f1) {
                         return 0;
                     }
@@ -0,0 +1,98 @@
+#ifndef LANG_ID_MAPPED_FILE_H
+#define LANG_ID_MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "fmt/core.h"
+
+// A read-only memory mapping of a whole file, advised for sequential access unless told otherwise.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path, int advice = MADV_SEQUENTIAL) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << fmt::format("open {} fail:{}", path, std::strerror(errno)) << std::endl;
+            abort();
+        }
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                std::cerr << fmt::format("mmap {} fail:{}", path, std::strerror(errno))
+                    << std::endl;
+                abort();
+            }
+            data_ = static_cast<const char *>(addr);
+            madvise(addr, size_, advice);
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    std::string_view content() const {
+        return std::string_view(data_, size_);
+    }
+
+    // Tells the kernel the pages before offset will not be read again, so that files larger than
+    // RAM do not push everything else out of the page cache.
+    void release(size_t offset) const {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t end = offset / page_size * page_size;
+        if (end > 0) {
+            madvise(const_cast<char *>(data_), end, MADV_DONTNEED);
+        }
+    }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Splits a mapped file into lines the way std::getline does, handing out views into the mapping.
+class LineReader {
+public:
+    explicit LineReader(const MappedFile &file) : file_(file), content_(file.content()) {}
+
+    bool next(std::string_view &line) {
+        if (pos_ >= content_.size()) {
+            return false;
+        }
+        size_t end = content_.find('\n', pos_);
+        if (end == std::string_view::npos) {
+            end = content_.size();
+        }
+        line = content_.substr(pos_, end - pos_);
+        pos_ = end + 1;
+        if (pos_ - released_ >= RELEASE_INTERVAL) {
+            file_.release(pos_);
+            released_ = pos_;
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t RELEASE_INTERVAL = 1 << 26;
+
+    const MappedFile &file_;
+    std::string_view content_;
+    size_t pos_ = 0;
+    size_t released_ = 0;
+};
+
+#endif
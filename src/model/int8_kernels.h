@@ -0,0 +1,72 @@
+#ifndef LANG_ID_INT8_KERNELS_H
+#define LANG_ID_INT8_KERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Int8 vectors are symmetric, in [-127, 127], and padded with zeros to a multiple of this many
+// values, so that the kernels below never handle a tail.
+inline constexpr int INT8_BLOCK = 32;
+
+inline int int8Stride(int dim) {
+    return (dim + INT8_BLOCK - 1) / INT8_BLOCK * INT8_BLOCK;
+}
+
+// Writes x[0, dim) to q as int8 scaled by the returned value, and zeros up to int8Stride(dim).
+inline float quantizeInt8(const float *x, int dim, int8_t *q) {
+    float max_abs = 0;
+    for (int i = 0; i < dim; ++i) {
+        max_abs = std::max(max_abs, std::abs(x[i]));
+    }
+    float scale = max_abs == 0 ? 1 : max_abs / 127;
+    float inverse = 1 / scale;
+    for (int i = 0; i < dim; ++i) {
+        q[i] = static_cast<int8_t>(std::lrint(std::clamp(x[i] * inverse, -127.0f, 127.0f)));
+    }
+    std::fill(q + dim, q + int8Stride(dim), 0);
+    return scale;
+}
+
+// The dot product of the int8 vectors a and b of length stride, a multiple of INT8_BLOCK.
+//
+// x86 multiplies unsigned bytes by signed ones, so |a| is multiplied by b carrying the sign of a.
+// With both in [-127, 127] the pairwise sums of the AVX2 path stay within int16.
+inline int32_t dotInt8(const int8_t *a, const int8_t *b, int stride) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__) || defined(__AVXVNNI__) || defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+#if !(defined(__AVX512VNNI__) && defined(__AVX512VL__) || defined(__AVXVNNI__))
+    const __m256i ones = _mm256_set1_epi16(1);
+#endif
+    for (int i = 0; i < stride; i += INT8_BLOCK) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        __m256i abs_a = _mm256_abs_epi8(va);
+        __m256i signed_b = _mm256_sign_epi8(vb, va);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        acc = _mm256_dpbusd_epi32(acc, abs_a, signed_b);
+#elif defined(__AVXVNNI__)
+        acc = _mm256_dpbusd_avx_epi32(acc, abs_a, signed_b);
+#else
+        __m256i pairs = _mm256_maddubs_epi16(abs_a, signed_b);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+#endif
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+#else
+    int32_t sum = 0;
+    for (int i = 0; i < stride; ++i) {
+        sum += static_cast<int32_t>(a[i]) * b[i];
+    }
+    return sum;
+#endif
+}
+
+#endif
@@ -1,12 +1,24 @@
 #ifndef INSNET_BENCHMARK_TRANSFORMER_MODEL_H
 #define INSNET_BENCHMARK_TRANSFORMER_MODEL_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory_resource>
+#include <unordered_map>
 #include <vector>
 #include "insnet/insnet.h"
 #include "def.h"
+#include "dataset.h"
 #include "params.h"
+#include "word_enc_cache.h"
+#include "word_table.h"
 
-inline void print(const std::vector<int> ids, insnet::Vocab &vocab) {
+inline void print(IdSpan ids, insnet::Vocab &vocab) {
     using std::cout;
     using std::endl;
     for (int id : ids) {
@@ -30,7 +42,7 @@ inline insnet::Node *wordEnc(const std::vector<int> &word, insnet::Graph &graph,
         insnet::dtype dropout) {
     using insnet::Node;
 
-    if (word.size() > 32) {
+    if (word.size() > MAX_WORD_LEN) {
         abort();
     }
 
@@ -41,6 +53,97 @@ inline insnet::Node *wordEnc(const std::vector<int> &word, insnet::Graph &graph,
     return enc;
 }
 
+inline std::vector<insnet::dtype> nodeValues(insnet::Node &node) {
+    std::vector<insnet::dtype> ret(node.size());
+    for (int i = 0; i < ret.size(); ++i) {
+        ret.at(i) = node.getVal()[i];
+    }
+    return ret;
+}
+
+// Counts the words looked up by every WordEncDedup in the process, how many of them were already
+// encoded in their graph, and how many of the rest were read from a word table.
+struct WordEncStats {
+    std::atomic<int64_t> lookup_num = 0;
+    std::atomic<int64_t> hit_num = 0;
+    std::atomic<int64_t> table_hit_num = 0;
+
+    float hitRate() const {
+        return lookup_num == 0 ? 0 : static_cast<float>(hit_num) / lookup_num;
+    }
+};
+
+inline WordEncStats &wordEncStats() {
+    static WordEncStats stats;
+    return stats;
+}
+
+// Where WordEncDedup looks for a word's encoding before running the word encoder, in this order.
+// Either may be null.
+struct WordEncSources {
+    const WordTable *table = nullptr;
+    WordEncCache *cache = nullptr;
+};
+
+// Encodes each distinct word once per graph and hands out the same node for every occurrence of
+// it. Occurrences only encode alike where dropout does not apply, so this is for inference graphs.
+// Words found in the table or cache of sources are read from them instead of being run through the
+// word encoder, and the words that were run are added to the cache by storeEncodings.
+class WordEncDedup {
+public:
+    explicit WordEncDedup(const WordEncSources &sources = {}) : sources_(sources) {}
+    WordEncDedup(const WordEncDedup &) = delete;
+    WordEncDedup &operator=(const WordEncDedup &) = delete;
+
+    ~WordEncDedup() {
+        wordEncStats().lookup_num += lookup_num_;
+        wordEncStats().hit_num += lookup_num_ - nodes_.size();
+        wordEncStats().table_hit_num += table_hit_num_;
+    }
+
+    insnet::Node *encode(const std::vector<int> &word, insnet::Graph &graph,
+            ModelParams &params) {
+        ++lookup_num_;
+        auto it = nodes_.emplace(word, nullptr).first;
+        insnet::Node *&node = it->second;
+        if (node != nullptr) {
+            return node;
+        }
+        const WordTable *table = sources_.table;
+        const insnet::dtype *row = table == nullptr ? nullptr : table->find(word);
+        if (row != nullptr) {
+            ++table_hit_num_;
+            node = insnet::tensor(graph, std::vector<insnet::dtype>(row, row + table->dim()));
+        } else if (sources_.cache != nullptr && sources_.cache->find(word, vals_)) {
+            node = insnet::tensor(graph, vals_);
+        } else {
+            node = wordEnc(word, graph, params, 0);
+            if (sources_.cache != nullptr) {
+                encoded_.push_back(&*it);
+            }
+        }
+        return node;
+    }
+
+    // Adds the words run through the word encoder to the cache. Call it after the graph's forward
+    // pass, which computes their values.
+    void storeEncodings() {
+        for (auto *encoded : encoded_) {
+            sources_.cache->insert(encoded->first, nodeValues(*encoded->second));
+        }
+        encoded_.clear();
+    }
+
+private:
+    WordEncSources sources_;
+    std::unordered_map<std::vector<int>, insnet::Node *, IdsHash> nodes_;
+    // Entries of nodes_, which keeps its elements in place as it grows.
+    std::vector<std::pair<const std::vector<int>, insnet::Node *> *> encoded_;
+    std::vector<insnet::dtype> vals_;
+    int64_t lookup_num_ = 0;
+    int64_t table_hit_num_ = 0;
+};
+
 inline insnet::Node *segEnc(insnet::Node &input, ModelParams &params, insnet::dtype dropout) {
     using insnet::Node;
     Node *enc = insnet::transformerEncoder(input, params.seg_enc, dropout).back();
@@ -78,91 +181,395 @@ inline std::pair<insnet::Node *, std::vector<insnet::LSTMState>> sentEnc(
         std::vector<insnet::LSTMState> &last_states,
         insnet::Graph &graph,
         ModelParams &params,
-        insnet::dtype dropout) {
+        insnet::dtype dropout,
+        WordEncDedup *dedup = nullptr) {
     using insnet::Node;
     using std::vector;
     vector<Node *> seg_inputs;
     seg_inputs.push_back(&seg_symbol_emb);
     for (const auto &e : seg_words) {
-        Node *input = e.first.empty() ? insnet::embedding(graph, e.second, params.emb.E) :
-            wordEnc(e.first, graph, params, dropout);
+        Node *input;
+        if (e.first.empty()) {
+            input = insnet::embedding(graph, e.second, params.emb.E);
+        } else if (dedup != nullptr) {
+            input = dedup->encode(e.first, graph, params);
+        } else {
+            input = wordEnc(e.first, graph, params, dropout);
+        }
         seg_inputs.push_back(input);
     }
     Node *merged = cat(seg_inputs);
     return sentEnc(*merged, last_states, params, dropout);
 }
 
-inline insnet::Node *sentEnc(const std::vector<int> &sent, int seg_len, int seg_symbol_id,
-        insnet::Graph &graph,
-        ModelParams &params,
-        insnet::dtype dropout,
-        std::vector<insnet::LSTMState> &initial_state,
-        bool early_exit = false) {
-    using insnet::Node;
-    using std::make_pair;
-    using std::vector;
-    using std::pair;
+// Returns the number of segments sentEnc splits sent into, without building any node.
+inline int segmentCount(IdSpan sent, int seg_len, int word_symbol_id) {
+    int seg_num = 0;
+    int unit_num = 0;
+    bool in_word = false;
+    for (int i = 0; i < sent.size(); ++i) {
+        int id = sent.at(i);
+        if (id == word_symbol_id) {
+            in_word = true;
+        } else if (id == -1) {
+            in_word = false;
+            continue;
+        }
 
-    int word_symbol_id = params.emb.vocab.from_string(WORD_SYMBOL);
+        if (!in_word || i == sent.size() - 1 || sent.at(i + 1) == word_symbol_id ||
+                sent.at(i + 1) == -1) {
+            ++unit_num;
+        }
+        if (unit_num == seg_len - 1 || i == sent.size() - 1) {
+            ++seg_num;
+            unit_num = 0;
+        }
+    }
+    return seg_num;
+}
 
-    enum State {
-        IN_WORD = 0,
-        IN_CHAR = 1,
-    };
+// Estimates the multiply-adds sentEnc spends on a sent, counting only the transformer layers, which
+// dominate it. A layer over n positions of dim d takes about 12nd^2 for its projections and
+// feed-forward block and 2n^2d for attention, so a long word or a full segment costs much more
+// than its share of segments suggests.
+struct EncoderCost {
+    int dim;
+    int word_layer;
+    int seg_layer;
 
-    vector<int> word;
-    vector<pair<vector<int>, int>> word_seg;
-    word.reserve(sent.size());
-    auto last_state = initial_state;
-    vector<Node *> log_probs;
-    log_probs.reserve(sent.size());
+    int64_t layerCost(int64_t len) const {
+        return 12 * len * dim * dim + 2 * len * len * dim;
+    }
 
-    Node *seg_emb = insnet::embedding(graph, seg_symbol_id, params.emb.E);
-    State state = IN_CHAR;
+    // Walks sent the way segmentCount does, charging every word to the word encoder and every
+    // segment, with its <SEG> symbol, to the segment encoder.
+    int64_t sentCost(IdSpan sent, int seg_len, int word_symbol_id) const {
+        int64_t cost = 0;
+        int unit_num = 0;
+        int word_len = 0;
+        bool in_word = false;
+        for (int i = 0; i < sent.size(); ++i) {
+            int id = sent[i];
+            if (id == word_symbol_id) {
+                in_word = true;
+            } else if (id == -1) {
+                in_word = false;
+                continue;
+            }
 
-    for (int i = 0; i < sent.size(); ++i) {
-        int id = sent.at(i);
-        if (id == word_symbol_id) {
-            state = IN_WORD;
+            bool last = i == sent.size() - 1;
+            if (in_word) {
+                ++word_len;
+                if (last || sent[i + 1] == word_symbol_id || sent[i + 1] == -1) {
+                    cost += word_layer * layerCost(word_len);
+                    word_len = 0;
+                    ++unit_num;
+                }
+            } else {
+                ++unit_num;
+            }
+            if (unit_num == seg_len - 1 || last) {
+                cost += seg_layer * layerCost(unit_num + 1);
+                unit_num = 0;
+            }
+        }
+        return cost;
+    }
+};
+
+// A segment is a list of units, each either a word as its char ids paired with -1, or a char
+// outside any word as an empty vector paired with the char id.
+using Segment = std::vector<std::pair<std::vector<int>, int>>;
+
+// The same units as spans of the doc's ids, which the static engine reads in place, with the
+// units themselves allocated from a memory resource.
+using SegmentView = std::pmr::vector<std::pair<IdSpan, int>>;
+
+// SegmentT is Segment or SegmentView.
+template <typename SegmentT>
+int charCount(const SegmentT &segment) {
+    int ret = 0;
+    for (const auto &unit : segment) {
+        // A word starts with its <WORD> symbol.
+        ret += unit.first.empty() ? 1 : unit.first.size() - 1;
+    }
+    return ret;
+}
+
+// Decides after which segment early exit stops reading a document. The defaults stop once the top
+// class prob exceeds 0.9999 or after 65 segments.
+struct EarlyExitPolicy {
+    insnet::dtype prob_threshold = 0.9999;
+    // Stops once the top class prob exceeds the second one by more than this.
+    insnet::dtype margin = 1;
+    int max_seg_num = 65;
+    // Stops after the segment in which this many chars have been read.
+    int max_char_num = std::numeric_limits<int>::max();
+
+    // LogProb is a vector of dtype with any allocator.
+    template <typename LogProb>
+    bool shouldStop(const LogProb &log_prob, int seg_num, int char_num) const {
+        if (seg_num >= max_seg_num || char_num >= max_char_num) {
+            return true;
+        }
+        insnet::dtype top1 = -std::numeric_limits<insnet::dtype>::infinity();
+        insnet::dtype top2 = top1;
+        for (insnet::dtype p : log_prob) {
+            if (p > top1) {
+                top2 = top1;
+                top1 = p;
+            } else if (p > top2) {
+                top2 = p;
+            }
+        }
+        insnet::dtype prob = std::exp(top1);
+        return prob > prob_threshold || prob - std::exp(top2) > margin;
+    }
+
+    // Drops the segments that would never be read because a budget runs out before them.
+    void truncate(std::vector<Segment> &segments) const {
+        int char_num = 0;
+        for (int i = 0; i < segments.size(); ++i) {
+            char_num += charCount(segments.at(i));
+            if (i + 1 >= max_seg_num || char_num >= max_char_num) {
+                segments.resize(i + 1);
+                break;
+            }
+        }
+    }
+};
+
+// Groups a stream of token ids into segments of at most seg_len - 1 units. Ids are pushed one at
+// a time, so a document can be segmented as far as it has been read.
+class Segmenter {
+public:
+    Segmenter(int seg_len, insnet::Vocab &vocab) : seg_len_(seg_len), vocab_(vocab),
+        word_symbol_id_(vocab.from_string(WORD_SYMBOL)) {}
+
+    void push(int id) {
+        if (has_pending_) {
+            consume(pending_, id == word_symbol_id_ || id == -1, false);
+        }
+        pending_ = id;
+        has_pending_ = true;
+    }
+
+    // Marks the end of the stream and flushes the last segment.
+    void finish() {
+        if (has_pending_) {
+            consume(pending_, true, true);
+            has_pending_ = false;
+        }
+        // A stream ending in a separator leaves its last units unflushed by consume.
+        if (!word_seg_.empty()) {
+            segments_.push_back(std::move(word_seg_));
+            word_seg_.clear();
+        }
+    }
+
+    // Complete segments not yet taken by the caller.
+    std::deque<Segment> &segments() {
+        return segments_;
+    }
+
+private:
+    void consume(int id, bool word_end, bool last) {
+        if (id == word_symbol_id_) {
+            in_word_ = true;
         } else if (id == -1) {
-            state = IN_CHAR;
-            continue;
+            in_word_ = false;
+            return;
         }
 
-        if (state == IN_WORD) {
-            word.push_back(id);
-            if (i == sent.size() - 1 || sent.at(i + 1) == word_symbol_id || sent.at(i + 1) == -1) {
-                if (word.size() > 32) {
-                    std::cerr << "word size:" << word.size() << std::endl;
-                    print(sent, params.emb.vocab);
-                    print(word, params.emb.vocab);
+        if (in_word_) {
+            word_.push_back(id);
+            if (word_end) {
+                if (word_.size() > MAX_WORD_LEN) {
+                    std::cerr << "word size:" << word_.size() << std::endl;
+                    print(word_, vocab_);
                     abort();
                 }
-                word_seg.push_back(make_pair(word, -1));
-                word.clear();
+                word_seg_.push_back(std::make_pair(word_, -1));
+                word_.clear();
             }
         } else {
-            word_seg.push_back(make_pair(vector<int>(), id));
+            word_seg_.push_back(std::make_pair(std::vector<int>(), id));
+        }
+        if (word_seg_.size() == seg_len_ - 1 || last) {
+            segments_.push_back(std::move(word_seg_));
+            word_seg_.clear();
         }
-        if (word_seg.size() == seg_len - 1 || i == sent.size() - 1) {
-            auto r = sentEnc(word_seg, *seg_emb, last_state, graph, params, dropout);
+    }
 
-            last_state = r.second;
-            log_probs.push_back(r.first);
-            word_seg.clear();
+    int seg_len_;
+    insnet::Vocab &vocab_;
+    int word_symbol_id_;
+    bool in_word_ = false;
+    bool has_pending_ = false;
+    int pending_;
+    std::vector<int> word_;
+    Segment word_seg_;
+    std::deque<Segment> segments_;
+};
 
-            if (early_exit) {
-                graph.forward();
-                int class_i = insnet::argmax({r.first}, r.first->size()).back().back();
-                float prob = std::exp(r.first->getVal()[class_i]);
-                if (prob > 0.9999 || log_probs.size() > 64) {
-                    break;
-                }
+// Cuts a doc into the segments Segmenter cuts it into, one at a time and as views of the doc's ids,
+// so that no id is copied.
+class SegmentReader {
+public:
+    SegmentReader(IdSpan doc, int seg_len, int word_symbol_id) : doc_(doc), seg_len_(seg_len),
+        word_symbol_id_(word_symbol_id) {}
+
+    // Fills segment with the next segment, or returns false if the doc has been read.
+    bool next(SegmentView &segment) {
+        segment.clear();
+        while (pos_ < doc_.size() && segment.size() < seg_len_ - 1) {
+            int id = doc_[pos_];
+            if (id == -1) {
+                ++pos_;
+                continue;
+            }
+            if (id != word_symbol_id_) {
+                segment.push_back(std::make_pair(IdSpan(), id));
+                ++pos_;
+                continue;
             }
+            size_t begin = pos_++;
+            while (pos_ < doc_.size() && doc_[pos_] != word_symbol_id_ && doc_[pos_] != -1) {
+                ++pos_;
+            }
+            if (pos_ - begin > MAX_WORD_LEN) {
+                std::cerr << "word size:" << pos_ - begin << std::endl;
+                abort();
+            }
+            segment.push_back(std::make_pair(doc_.subspan(begin, pos_ - begin), -1));
         }
+        return !segment.empty();
+    }
+
+private:
+    IdSpan doc_;
+    int seg_len_;
+    int word_symbol_id_;
+    size_t pos_ = 0;
+};
+
+// Splits sent into segments, stopping after max_seg_num segments.
+inline std::vector<Segment> splitIntoSegments(IdSpan sent, int seg_len,
+        insnet::Vocab &vocab,
+        int max_seg_num = std::numeric_limits<int>::max()) {
+    Segmenter segmenter(seg_len, vocab);
+    for (int i = 0; i < sent.size() && segmenter.segments().size() < max_seg_num; ++i) {
+        segmenter.push(sent.at(i));
+    }
+    if (segmenter.segments().size() < max_seg_num) {
+        segmenter.finish();
+    }
+    auto &segments = segmenter.segments();
+    return std::vector<Segment>(std::make_move_iterator(segments.begin()),
+            std::make_move_iterator(segments.end()));
+}
+
+inline insnet::Node *sentEnc(const std::vector<Segment> &segments, int seg_symbol_id,
+        insnet::Graph &graph,
+        ModelParams &params,
+        insnet::dtype dropout,
+        std::vector<insnet::LSTMState> &initial_state,
+        WordEncDedup *dedup = nullptr) {
+    using insnet::Node;
+    using std::vector;
+
+    auto last_state = initial_state;
+    vector<Node *> log_probs;
+    log_probs.reserve(segments.size());
+
+    Node *seg_emb = insnet::embedding(graph, seg_symbol_id, params.emb.E);
+    for (const Segment &segment : segments) {
+        auto r = sentEnc(segment, *seg_emb, last_state, graph, params, dropout, dedup);
+        last_state = r.second;
+        log_probs.push_back(r.first);
     }
 
     return cat(log_probs);
 }
 
+inline insnet::Node *sentEnc(IdSpan sent, int seg_len, int seg_symbol_id,
+        insnet::Graph &graph,
+        ModelParams &params,
+        insnet::dtype dropout,
+        std::vector<insnet::LSTMState> &initial_state,
+        WordEncDedup *dedup = nullptr) {
+    auto segments = splitIntoSegments(sent, seg_len, params.emb.vocab);
+    return sentEnc(segments, seg_symbol_id, graph, params, dropout, initial_state, dedup);
+}
+
+// Runs a document through the model one segment at a time until policy stops it or next_segment
+// runs out, and returns the log probs of the last segment run. next_segment is only asked for as
+// many segments as are run. Each segment gets its own small graph whose LSTM starts from the values
+// the previous segment left, so earlier segments are never rebuilt or recomputed.
+inline std::vector<insnet::dtype> earlyExitSentEnc(
+        const std::function<bool(Segment &)> &next_segment,
+        int seg_symbol_id,
+        ModelParams &params,
+        const EarlyExitPolicy &policy,
+        int &seg_num,
+        const WordEncSources &word_enc_sources = {}) {
+    using insnet::dtype;
+    using insnet::Node;
+    using std::vector;
+
+    int layer = params.sent_enc.size();
+    int dim = params.word_enc.hiddenDim();
+    vector<vector<dtype>> hiddens(layer, vector<dtype>(dim, 0));
+    vector<vector<dtype>> cells(layer, vector<dtype>(dim, 0));
+    vector<dtype> log_prob;
+    int char_num = 0;
+    Segment segment;
+
+    for (seg_num = 0; next_segment(segment);) {
+        insnet::Graph graph(insnet::ModelStage::INFERENCE);
+        vector<insnet::LSTMState> last_states;
+        last_states.reserve(layer);
+        for (int i = 0; i < layer; ++i) {
+            last_states.push_back({insnet::tensor(graph, hiddens.at(i)),
+                    insnet::tensor(graph, cells.at(i))});
+        }
+        Node *seg_emb = insnet::embedding(graph, seg_symbol_id, params.emb.E);
+        WordEncDedup dedup(word_enc_sources);
+        auto r = sentEnc(segment, *seg_emb, last_states, graph, params, 0, &dedup);
+        graph.forward();
+        dedup.storeEncodings();
+
+        log_prob = nodeValues(*r.first);
+        for (int i = 0; i < layer; ++i) {
+            hiddens.at(i) = nodeValues(*r.second.at(i).hidden);
+            cells.at(i) = nodeValues(*r.second.at(i).cell);
+        }
+        char_num += charCount(segment);
+        if (policy.shouldStop(log_prob, ++seg_num, char_num)) {
+            break;
+        }
+    }
+
+    return log_prob;
+}
+
+inline std::vector<insnet::dtype> earlyExitSentEnc(IdSpan sent, int seg_len,
+        int seg_symbol_id,
+        ModelParams &params,
+        const EarlyExitPolicy &policy,
+        int &seg_num,
+        const WordEncSources &word_enc_sources = {}) {
+    auto segments = splitIntoSegments(sent, seg_len, params.emb.vocab, policy.max_seg_num);
+    int seg_i = 0;
+    auto next_segment = [&](Segment &segment) {
+        if (seg_i == segments.size()) {
+            return false;
+        }
+        segment = std::move(segments.at(seg_i++));
+        return true;
+    };
+    return earlyExitSentEnc(next_segment, seg_symbol_id, params, policy, seg_num,
+            word_enc_sources);
+}
+
 #endif
@@ -0,0 +1,87 @@
+#ifndef LANG_ID_RANDOM_MODEL_H
+#define LANG_ID_RANDOM_MODEL_H
+
+#include <random>
+#include <vector>
+#include "insnet/insnet.h"
+#include "params.h"
+#include "model.h"
+
+// Random weights and docs for checking and benchmarking the model without a trained one.
+
+inline void randomize(insnet::Tensor2D &tensor, std::mt19937 &engine) {
+    std::uniform_real_distribution<insnet::dtype> dist(-0.5, 0.5);
+    for (size_t i = 0; i < static_cast<size_t>(tensor.row) * tensor.col; ++i) {
+        tensor.v[i] = dist(engine);
+    }
+}
+
+inline void randomize(insnet::LinearParams &params, std::mt19937 &engine) {
+    randomize(params.W().val, engine);
+    if (params.bias_enabled()) {
+        randomize(params.b().val, engine);
+    }
+}
+
+inline void randomize(insnet::LayerNormParams &params, std::mt19937 &engine) {
+    randomize(params.g().val, engine);
+    randomize(params.b().val, engine);
+}
+
+// Fills every weight StaticEngine reads with random values, biases and layer norms included, so
+// that no part of the model is left at an initial value that would hide a misplaced weight.
+inline void randomize(ModelParams &params, std::mt19937 &engine) {
+    randomize(params.emb.E.val, engine);
+    for (insnet::TransformerEncoderParams *encoder : {&params.word_enc, &params.seg_enc}) {
+        randomize(encoder->positionalEncodingParam().val, engine);
+        for (insnet::TransformerEncoderLayerParams *layer : encoder->layerParams().ptrs()) {
+            randomize(layer->layerNormA(), engine);
+            randomize(layer->kqvParams(), engine);
+            randomize(layer->headsFusionParams(), engine);
+            randomize(layer->layerNormB(), engine);
+            randomize(layer->ffnInnerParams(), engine);
+            randomize(layer->ffnOutterParams(), engine);
+        }
+    }
+    for (insnet::LSTMParams *lstm : params.sent_enc.ptrs()) {
+        for (insnet::LinearParams *gate : {&lstm->input_hidden, &lstm->input_input,
+                &lstm->output_hidden, &lstm->output_input, &lstm->forget_hidden,
+                &lstm->forget_input, &lstm->cell_hidden, &lstm->cell_input}) {
+            randomize(*gate, engine);
+        }
+    }
+    randomize(params.output, engine);
+#if USE_GPU
+    params.copyFromHostToDevice();
+#endif
+}
+
+// A tokenized doc of word_num words over char ids [3, 3 + char_num): words of up to
+// MAX_WORD_LEN ids, some repeated within a segment, and runs of separated CJK-like chars.
+inline std::vector<int> randomDoc(int word_num, int char_num, int word_symbol_id,
+        std::mt19937 &engine) {
+    std::uniform_int_distribution<int> char_id(3, 2 + char_num);
+    std::uniform_int_distribution<int> word_len(1, MAX_WORD_LEN - 1);
+    std::uniform_int_distribution<int> kind(0, 9);
+    std::vector<int> ret;
+    std::vector<int> last_word;
+    for (int w = 0; w < word_num; ++w) {
+        int k = kind(engine);
+        if (k == 0) {
+            ret.push_back(-1);
+            ret.push_back(char_id(engine));
+        } else if (k == 1 && !last_word.empty()) {
+            ret.insert(ret.end(), last_word.begin(), last_word.end());
+        } else {
+            last_word = {word_symbol_id};
+            int len = k == 2 ? word_len(engine) : 1 + kind(engine) % 4;
+            for (int i = 0; i < len; ++i) {
+                last_word.push_back(char_id(engine));
+            }
+            ret.insert(ret.end(), last_word.begin(), last_word.end());
+        }
+    }
+    return ret;
+}
+
+#endif
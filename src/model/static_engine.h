@@ -0,0 +1,765 @@
+#ifndef LANG_ID_STATIC_ENGINE_H
+#define LANG_ID_STATIC_ENGINE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory_resource>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "fmt/core.h"
+#include "insnet/insnet.h"
+#include "dataset.h"
+#include "int8_kernels.h"
+#include "params.h"
+#include "model.h"
+
+// A forward-only replica of the inference path of model.h for a trained ModelParams: the word
+// encoder, the segment encoder, the LSTM layers and the output layer, run straight on copies of
+// the weights without building a graph. The topology never changes, so every buffer is planned
+// from the dims once and reused for every word and segment of a document.
+//
+// The engine is read-only after construction and may be shared by threads, each with its own
+// Workspace. It runs on the CPU, reading the weights from host memory. Workspaces and states take
+// their buffers from a memory resource, so that a worker can serve them from an Arena.
+//
+// quantize converts the matrices and the embeddings to int8 with a scale per output row or per
+// embedding, after which every linear layer quantizes its input per column and runs in int8. Such
+// an engine is saved and loaded on its own by saveQuantizedModel and loadQuantizedModel.
+class StaticEngine {
+public:
+    // The scratch buffers of one thread, sized for the longest input either encoder takes.
+    class Workspace {
+    public:
+        explicit Workspace(const StaticEngine &engine,
+                std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+            inputs_(resource), x_(resource), normed_(resource), kqv_(resource),
+            attended_(resource), scores_(resource), inner_(resource), outer_(resource),
+            gates_(resource), lstm_input_(resource), layer_(resource), quantized_(resource),
+            column_scales_(resource) {
+            int dim = engine.dim_;
+            int len = std::max(engine.word_enc_.max_len, engine.seg_enc_.max_len);
+            int ffn_dim = std::max(engine.word_enc_.ffnDim(), engine.seg_enc_.ffnDim());
+            inputs_.resize(len * dim);
+            x_.resize(len * dim);
+            normed_.resize(len * dim);
+            kqv_.resize(len * 3 * dim);
+            attended_.resize(len * dim);
+            scores_.resize(len);
+            inner_.resize(len * ffn_dim);
+            outer_.resize(len * dim);
+            gates_.resize(4 * dim);
+            lstm_input_.resize(2 * dim);
+            layer_.resize(dim);
+            if (engine.quantized()) {
+                int stride = int8Stride(std::max(ffn_dim, 2 * dim));
+                quantized_.resize(len * stride);
+                column_scales_.resize(len);
+            }
+        }
+
+    private:
+        friend class StaticEngine;
+
+        std::pmr::vector<insnet::dtype> inputs_;
+        std::pmr::vector<insnet::dtype> x_;
+        std::pmr::vector<insnet::dtype> normed_;
+        std::pmr::vector<insnet::dtype> kqv_;
+        std::pmr::vector<insnet::dtype> attended_;
+        std::pmr::vector<insnet::dtype> scores_;
+        std::pmr::vector<insnet::dtype> inner_;
+        std::pmr::vector<insnet::dtype> outer_;
+        std::pmr::vector<insnet::dtype> gates_;
+        std::pmr::vector<insnet::dtype> lstm_input_;
+        std::pmr::vector<insnet::dtype> layer_;
+        // The int8 input columns of a quantized linear layer and their scales.
+        std::pmr::vector<int8_t> quantized_;
+        std::pmr::vector<float> column_scales_;
+    };
+
+    // The LSTM hiddens and cells a document has reached, layer i at [i * dim, (i + 1) * dim).
+    struct State {
+        std::pmr::vector<insnet::dtype> hiddens;
+        std::pmr::vector<insnet::dtype> cells;
+    };
+
+    // An empty engine for loadQuantizedModel to fill.
+    StaticEngine() = default;
+
+    explicit StaticEngine(ModelParams &params) : dim_(params.word_enc.hiddenDim()),
+        vocab_size_(params.emb.E.val.col), word_enc_(encoderWeights(params.word_enc)),
+        seg_enc_(encoderWeights(params.seg_enc)), output_(linearWeights(params.output)) {
+        const insnet::Tensor2D &emb = params.emb.E.val;
+        emb_.assign(emb.v, emb.v + static_cast<size_t>(emb.row) * emb.col);
+        for (insnet::LSTMParams *lstm : params.sent_enc.ptrs()) {
+            lstms_.push_back(lstmWeights(*lstm));
+        }
+    }
+
+    int dim() const {
+        return dim_;
+    }
+
+    bool quantized() const {
+        return !quantized_emb_.empty();
+    }
+
+    void quantize() {
+        static_assert(std::is_same_v<insnet::dtype, float>, "the int8 kernels read floats");
+        if (quantized()) {
+            return;
+        }
+        int stride = int8Stride(dim_);
+        quantized_emb_.resize(static_cast<size_t>(vocab_size_) * stride);
+        emb_scales_.resize(vocab_size_);
+        for (int i = 0; i < vocab_size_; ++i) {
+            emb_scales_.at(i) = quantizeInt8(emb_.data() + static_cast<size_t>(i) * dim_, dim_,
+                    quantized_emb_.data() + static_cast<size_t>(i) * stride);
+        }
+        emb_ = std::vector<insnet::dtype>();
+        forEachLinear(*this, [](Linear &layer) {
+            layer.quantize();
+        });
+    }
+
+    // The bytes taken by the weights, for comparing an engine with its quantized copy.
+    size_t weightBytes() const {
+        size_t ret = emb_.size() * sizeof(insnet::dtype) + quantized_emb_.size() +
+            emb_scales_.size() * sizeof(float);
+        for (const Encoder *encoder : {&word_enc_, &seg_enc_}) {
+            ret += encoder->positions.size() * sizeof(insnet::dtype);
+            for (const EncoderLayer &layer : encoder->layers) {
+                for (const LayerNorm *norm : {&layer.norm_a, &layer.norm_b}) {
+                    ret += (norm->g.size() + norm->b.size()) * sizeof(insnet::dtype);
+                }
+            }
+        }
+        forEachLinear(*this, [&](const Linear &layer) {
+            ret += layer.bytes();
+        });
+        return ret;
+    }
+
+    template<typename Archive>
+    void serialize(Archive &ar) {
+        ar(dim_, vocab_size_, emb_, quantized_emb_, emb_scales_, word_enc_, seg_enc_, lstms_,
+                output_);
+    }
+
+    State initialState(std::pmr::memory_resource *resource =
+            std::pmr::get_default_resource()) const {
+        size_t size = lstms_.size() * dim_;
+        return {std::pmr::vector<insnet::dtype>(size, 0, resource),
+            std::pmr::vector<insnet::dtype>(size, 0, resource)};
+    }
+
+    // Writes the dim values encoding word, its <WORD> symbol first, to out, as wordEnc computes
+    // them.
+    void wordEnc(IdSpan word, Workspace &ws, insnet::dtype *out) const {
+        if (word.size() > MAX_WORD_LEN || word.size() > word_enc_.max_len) {
+            std::cerr << "word size:" << word.size() << std::endl;
+            abort();
+        }
+        for (int i = 0; i < word.size(); ++i) {
+            embed(word.at(i), ws.x_.data() + i * dim_);
+        }
+        encode(word_enc_, word.size(), ws);
+        std::copy(ws.x_.begin(), ws.x_.begin() + dim_, out);
+    }
+
+    // Runs segment through the segment encoder, the LSTM layers from state and the output layer,
+    // as the sentEnc overload for a Segment does, leaving the new state in state and the class
+    // log probs in log_prob. Words are read from sources where they can be. SegmentT is Segment
+    // or SegmentView.
+    template <typename SegmentT>
+    void segmentEnc(const SegmentT &segment, int seg_symbol_id, const WordEncSources &sources,
+            Workspace &ws,
+            State &state,
+            std::pmr::vector<insnet::dtype> &log_prob) const {
+        int len = segment.size() + 1;
+        if (len > seg_enc_.max_len) {
+            std::cerr << "segment size:" << segment.size() << std::endl;
+            abort();
+        }
+        // Encoding a word reuses the encoder buffers, so the input columns are gathered in their
+        // own buffer first. Like WordEncDedup, a word repeated in the segment is encoded once.
+        insnet::dtype *inputs = ws.inputs_.data();
+        embed(seg_symbol_id, inputs);
+        int64_t word_num = 0, dup_num = 0, table_hit_num = 0;
+        for (int i = 0; i < segment.size(); ++i) {
+            const auto &unit = segment.at(i);
+            insnet::dtype *column = inputs + (i + 1) * dim_;
+            if (unit.first.empty()) {
+                embed(unit.second, column);
+                continue;
+            }
+            ++word_num;
+            int same = i - 1;
+            while (same >= 0 && !sameIds(segment.at(same).first, unit.first)) {
+                --same;
+            }
+            if (same >= 0) {
+                ++dup_num;
+                std::copy_n(inputs + (same + 1) * dim_, dim_, column);
+                continue;
+            }
+            if (sources.table == nullptr && sources.cache == nullptr) {
+                wordEnc(unit.first, ws, column);
+                continue;
+            }
+            const std::vector<int> &key = wordKey(unit.first);
+            const insnet::dtype *row = sources.table == nullptr ? nullptr :
+                sources.table->find(key);
+            if (row != nullptr) {
+                ++table_hit_num;
+                std::copy_n(row, dim_, column);
+            } else if (sources.cache != nullptr && sources.cache->find(key, column)) {
+                continue;
+            } else {
+                wordEnc(unit.first, ws, column);
+                if (sources.cache != nullptr) {
+                    sources.cache->insert(key, column, dim_);
+                }
+            }
+        }
+        WordEncStats &stats = wordEncStats();
+        stats.lookup_num += word_num;
+        stats.hit_num += dup_num;
+        stats.table_hit_num += table_hit_num;
+
+        std::copy_n(inputs, len * dim_, ws.x_.data());
+        encode(seg_enc_, len, ws);
+
+        insnet::dtype *layer = ws.layer_.data();
+        std::copy_n(ws.x_.data(), dim_, layer);
+        for (int i = 0; i < lstms_.size(); ++i) {
+            insnet::dtype *hidden = state.hiddens.data() + i * dim_;
+            lstmStep(lstms_.at(i), layer, hidden, state.cells.data() + i * dim_, ws);
+            for (int j = 0; j < dim_; ++j) {
+                layer[j] += hidden[j];
+            }
+        }
+        log_prob.resize(output_.out_dim);
+        linear(output_, layer, 1, log_prob.data(), ws);
+        logSoftmax(log_prob);
+    }
+
+private:
+    // W is out_dim x in_dim in row-major order, so that each output is a contiguous dot product;
+    // b is empty if the layer has no bias. Once quantized, W is replaced by qw, whose rows are
+    // padded to stride, and row i is scales[i] times qw's.
+    struct Linear {
+        int in_dim;
+        int out_dim;
+        std::vector<insnet::dtype> w;
+        std::vector<insnet::dtype> b;
+        int stride = 0;
+        std::vector<int8_t> qw;
+        std::vector<float> scales;
+
+        bool quantized() const {
+            return !qw.empty();
+        }
+
+        void quantize() {
+            stride = int8Stride(in_dim);
+            qw.resize(static_cast<size_t>(out_dim) * stride);
+            scales.resize(out_dim);
+            for (int i = 0; i < out_dim; ++i) {
+                scales.at(i) = quantizeInt8(w.data() + static_cast<size_t>(i) * in_dim, in_dim,
+                        qw.data() + static_cast<size_t>(i) * stride);
+            }
+            w = std::vector<insnet::dtype>();
+        }
+
+        size_t bytes() const {
+            return (w.size() + b.size()) * sizeof(insnet::dtype) + qw.size() +
+                scales.size() * sizeof(float);
+        }
+
+        template<typename Archive>
+        void serialize(Archive &ar) {
+            ar(in_dim, out_dim, w, b, stride, qw, scales);
+        }
+    };
+
+    struct LayerNorm {
+        std::vector<insnet::dtype> g;
+        std::vector<insnet::dtype> b;
+
+        template<typename Archive>
+        void serialize(Archive &ar) {
+            ar(g, b);
+        }
+    };
+
+    struct EncoderLayer {
+        LayerNorm norm_a;
+        Linear kqv;
+        Linear heads_fusion;
+        LayerNorm norm_b;
+        Linear ffn_inner;
+        Linear ffn_outter;
+
+        template<typename Archive>
+        void serialize(Archive &ar) {
+            ar(norm_a, kqv, heads_fusion, norm_b, ffn_inner, ffn_outter);
+        }
+    };
+
+    struct Encoder {
+        int head_num;
+        int max_len;
+        // Column i is added to the input at position i.
+        std::vector<insnet::dtype> positions;
+        std::vector<EncoderLayer> layers;
+
+        int ffnDim() const {
+            return layers.empty() ? 0 : layers.front().ffn_inner.out_dim;
+        }
+
+        template<typename Archive>
+        void serialize(Archive &ar) {
+            ar(head_num, max_len, positions, layers);
+        }
+    };
+
+    // The four gates of an LSTM layer stacked into one linear layer over the previous hidden
+    // followed by the input, in the order input, output, forget and cell.
+    struct Lstm {
+        Linear gates;
+
+        template<typename Archive>
+        void serialize(Archive &ar) {
+            ar(gates);
+        }
+    };
+
+    // Calls f on every linear layer of engine, const or not.
+    template<typename Engine, typename F>
+    static void forEachLinear(Engine &engine, const F &f) {
+        for (auto *encoder : {&engine.word_enc_, &engine.seg_enc_}) {
+            for (auto &layer : encoder->layers) {
+                for (auto *linear : {&layer.kqv, &layer.heads_fusion, &layer.ffn_inner,
+                        &layer.ffn_outter}) {
+                    f(*linear);
+                }
+            }
+        }
+        for (auto &lstm : engine.lstms_) {
+            f(lstm.gates);
+        }
+        f(engine.output_);
+    }
+
+    // insnet keeps a matrix column by column, with row entries per column.
+    static Linear linearWeights(insnet::LinearParams &params) {
+        const insnet::Tensor2D &w = params.W().val;
+        Linear ret;
+        ret.out_dim = w.row;
+        ret.in_dim = w.col;
+        ret.w.resize(static_cast<size_t>(w.row) * w.col);
+        for (int i = 0; i < w.row; ++i) {
+            for (int j = 0; j < w.col; ++j) {
+                ret.w.at(static_cast<size_t>(i) * w.col + j) =
+                    w.v[static_cast<size_t>(j) * w.row + i];
+            }
+        }
+        if (params.bias_enabled()) {
+            const insnet::Tensor2D &b = params.b().val;
+            ret.b.assign(b.v, b.v + w.row);
+        }
+        return ret;
+    }
+
+    static LayerNorm layerNormWeights(insnet::LayerNormParams &params) {
+        const insnet::Tensor2D &g = params.g().val;
+        const insnet::Tensor2D &b = params.b().val;
+        return {std::vector<insnet::dtype>(g.v, g.v + g.row * g.col),
+            std::vector<insnet::dtype>(b.v, b.v + b.row * b.col)};
+    }
+
+    static Encoder encoderWeights(insnet::TransformerEncoderParams &params) {
+        Encoder ret;
+        ret.head_num = params.headCount();
+        const insnet::Tensor2D &positions = params.positionalEncodingParam().val;
+        ret.max_len = positions.col;
+        ret.positions.assign(positions.v, positions.v + positions.row * positions.col);
+        for (insnet::TransformerEncoderLayerParams *layer : params.layerParams().ptrs()) {
+            ret.layers.push_back({layerNormWeights(layer->layerNormA()),
+                    linearWeights(layer->kqvParams()), linearWeights(layer->headsFusionParams()),
+                    layerNormWeights(layer->layerNormB()), linearWeights(layer->ffnInnerParams()),
+                    linearWeights(layer->ffnOutterParams())});
+        }
+        return ret;
+    }
+
+    static Lstm lstmWeights(insnet::LSTMParams &params) {
+        std::pair<insnet::LinearParams *, insnet::LinearParams *> gates[] = {
+            {&params.input_hidden, &params.input_input},
+            {&params.output_hidden, &params.output_input},
+            {&params.forget_hidden, &params.forget_input},
+            {&params.cell_hidden, &params.cell_input},
+        };
+        Lstm ret;
+        Linear &stacked = ret.gates;
+        int dim = params.input_hidden.W().val.row;
+        int hidden_dim = params.input_hidden.W().val.col;
+        int input_dim = params.input_input.W().val.col;
+        stacked.out_dim = 4 * dim;
+        stacked.in_dim = hidden_dim + input_dim;
+        stacked.w.resize(static_cast<size_t>(stacked.out_dim) * stacked.in_dim);
+        stacked.b.assign(stacked.out_dim, 0);
+        for (int g = 0; g < 4; ++g) {
+            Linear hidden = linearWeights(*gates[g].first);
+            Linear input = linearWeights(*gates[g].second);
+            for (int i = 0; i < dim; ++i) {
+                insnet::dtype *row = stacked.w.data() +
+                    static_cast<size_t>(g * dim + i) * stacked.in_dim;
+                std::copy_n(hidden.w.data() + static_cast<size_t>(i) * hidden_dim, hidden_dim,
+                        row);
+                std::copy_n(input.w.data() + static_cast<size_t>(i) * input_dim, input_dim,
+                        row + hidden_dim);
+                insnet::dtype &bias = stacked.b.at(g * dim + i);
+                bias += hidden.b.empty() ? 0 : hidden.b.at(i);
+                bias += input.b.empty() ? 0 : input.b.at(i);
+            }
+        }
+        return ret;
+    }
+
+    void embed(int id, insnet::dtype *out) const {
+        if (id < 0 || id >= vocab_size_) {
+            std::cerr << "embedding id out of range:" << id << std::endl;
+            abort();
+        }
+        if (!quantized()) {
+            std::copy_n(emb_.data() + static_cast<size_t>(id) * dim_, dim_, out);
+            return;
+        }
+        const int8_t *q = quantized_emb_.data() + static_cast<size_t>(id) * int8Stride(dim_);
+        float scale = emb_scales_.at(id);
+        for (int i = 0; i < dim_; ++i) {
+            out[i] = q[i] * scale;
+        }
+    }
+
+    // y = Wx + b for each of the n columns of x. Each row of W is loaded once for all columns.
+    static void linear(const Linear &layer, const insnet::dtype *x, int n, insnet::dtype *y,
+            Workspace &ws) {
+        if (layer.quantized()) {
+            quantizedLinear(layer, x, n, y, ws);
+            return;
+        }
+        for (int i = 0; i < layer.out_dim; ++i) {
+            const insnet::dtype *row = layer.w.data() + static_cast<size_t>(i) * layer.in_dim;
+            insnet::dtype bias = layer.b.empty() ? 0 : layer.b[i];
+            for (int j = 0; j < n; ++j) {
+                const insnet::dtype *col = x + static_cast<size_t>(j) * layer.in_dim;
+                insnet::dtype sum = 0;
+                for (int k = 0; k < layer.in_dim; ++k) {
+                    sum += row[k] * col[k];
+                }
+                y[static_cast<size_t>(j) * layer.out_dim + i] = sum + bias;
+            }
+        }
+    }
+
+    // The int8 linear: each column of x is quantized with its own scale, so that every output is
+    // an int32 dot product times the scales of its row and column.
+    static void quantizedLinear(const Linear &layer, const insnet::dtype *x, int n,
+            insnet::dtype *y, Workspace &ws) {
+        int8_t *columns = ws.quantized_.data();
+        float *column_scales = ws.column_scales_.data();
+        for (int j = 0; j < n; ++j) {
+            column_scales[j] = quantizeInt8(x + static_cast<size_t>(j) * layer.in_dim,
+                    layer.in_dim, columns + static_cast<size_t>(j) * layer.stride);
+        }
+        for (int i = 0; i < layer.out_dim; ++i) {
+            const int8_t *row = layer.qw.data() + static_cast<size_t>(i) * layer.stride;
+            float row_scale = layer.scales[i];
+            insnet::dtype bias = layer.b.empty() ? 0 : layer.b[i];
+            for (int j = 0; j < n; ++j) {
+                int32_t dot = dotInt8(columns + static_cast<size_t>(j) * layer.stride, row,
+                        layer.stride);
+                y[static_cast<size_t>(j) * layer.out_dim + i] =
+                    dot * (row_scale * column_scales[j]) + bias;
+            }
+        }
+    }
+
+    void layerNorm(const LayerNorm &norm, const insnet::dtype *x, int n, insnet::dtype *y) const {
+        for (int j = 0; j < n; ++j) {
+            const insnet::dtype *col = x + j * dim_;
+            insnet::dtype mean = 0;
+            for (int k = 0; k < dim_; ++k) {
+                mean += col[k];
+            }
+            mean /= dim_;
+            insnet::dtype var = 0;
+            for (int k = 0; k < dim_; ++k) {
+                var += (col[k] - mean) * (col[k] - mean);
+            }
+            insnet::dtype scale = 1 / std::sqrt(var / dim_ + LAYER_NORM_EPS);
+            insnet::dtype *out = y + j * dim_;
+            for (int k = 0; k < dim_; ++k) {
+                out[k] = (col[k] - mean) * scale * norm.g[k] + norm.b[k];
+            }
+        }
+    }
+
+    // Runs the n input columns in ws.x_ through encoder, leaving the first column of the last
+    // layer, the only one the model reads, at the start of ws.x_. The last layer therefore only
+    // attends from and feeds forward that column.
+    void encode(const Encoder &encoder, int n, Workspace &ws) const {
+        insnet::dtype *x = ws.x_.data();
+        insnet::dtype input_scale = std::sqrt(static_cast<insnet::dtype>(dim_));
+        for (int i = 0; i < n * dim_; ++i) {
+            x[i] = x[i] * input_scale + encoder.positions[i];
+        }
+
+        int head_dim = dim_ / encoder.head_num;
+        insnet::dtype score_scale = 1 / std::sqrt(static_cast<insnet::dtype>(head_dim));
+        for (int l = 0; l < encoder.layers.size(); ++l) {
+            const EncoderLayer &layer = encoder.layers.at(l);
+            int query_num = l + 1 == encoder.layers.size() ? 1 : n;
+            layerNorm(layer.norm_a, x, n, ws.normed_.data());
+            linear(layer.kqv, ws.normed_.data(), n, ws.kqv_.data(), ws);
+
+            // Each position holds its key, query and value, dim values each, and every head reads
+            // its own head_dim rows of them.
+            const insnet::dtype *kqv = ws.kqv_.data();
+            insnet::dtype *scores = ws.scores_.data();
+            for (int h = 0; h < encoder.head_num; ++h) {
+                int offset = h * head_dim;
+                for (int t = 0; t < query_num; ++t) {
+                    const insnet::dtype *q = kqv + t * 3 * dim_ + dim_ + offset;
+                    insnet::dtype max_score = -std::numeric_limits<insnet::dtype>::infinity();
+                    for (int s = 0; s < n; ++s) {
+                        const insnet::dtype *k = kqv + s * 3 * dim_ + offset;
+                        insnet::dtype score = 0;
+                        for (int d = 0; d < head_dim; ++d) {
+                            score += q[d] * k[d];
+                        }
+                        scores[s] = score * score_scale;
+                        max_score = std::max(max_score, scores[s]);
+                    }
+                    insnet::dtype sum = 0;
+                    for (int s = 0; s < n; ++s) {
+                        scores[s] = std::exp(scores[s] - max_score);
+                        sum += scores[s];
+                    }
+                    insnet::dtype *out = ws.attended_.data() + t * dim_ + offset;
+                    std::fill_n(out, head_dim, 0);
+                    for (int s = 0; s < n; ++s) {
+                        const insnet::dtype *v = kqv + s * 3 * dim_ + 2 * dim_ + offset;
+                        insnet::dtype weight = scores[s] / sum;
+                        for (int d = 0; d < head_dim; ++d) {
+                            out[d] += weight * v[d];
+                        }
+                    }
+                }
+            }
+
+            linear(layer.heads_fusion, ws.attended_.data(), query_num, ws.outer_.data(), ws);
+            for (int i = 0; i < query_num * dim_; ++i) {
+                x[i] += ws.outer_[i];
+            }
+            layerNorm(layer.norm_b, x, query_num, ws.normed_.data());
+            linear(layer.ffn_inner, ws.normed_.data(), query_num, ws.inner_.data(), ws);
+            for (int i = 0; i < query_num * layer.ffn_inner.out_dim; ++i) {
+                ws.inner_[i] = std::max<insnet::dtype>(ws.inner_[i], 0);
+            }
+            linear(layer.ffn_outter, ws.inner_.data(), query_num, ws.outer_.data(), ws);
+            for (int i = 0; i < query_num * dim_; ++i) {
+                x[i] += ws.outer_[i];
+            }
+        }
+    }
+
+    // Advances one LSTM layer by input, updating hidden and cell in place.
+    void lstmStep(const Lstm &lstm, const insnet::dtype *input, insnet::dtype *hidden,
+            insnet::dtype *cell,
+            Workspace &ws) const {
+        insnet::dtype *joined = ws.lstm_input_.data();
+        std::copy_n(hidden, dim_, joined);
+        std::copy_n(input, dim_, joined + dim_);
+        insnet::dtype *gates = ws.gates_.data();
+        linear(lstm.gates, joined, 1, gates, ws);
+        auto sigmoid = [](insnet::dtype x) {
+            return 1 / (1 + std::exp(-x));
+        };
+        for (int i = 0; i < dim_; ++i) {
+            insnet::dtype input_gate = sigmoid(gates[i]);
+            insnet::dtype output_gate = sigmoid(gates[dim_ + i]);
+            insnet::dtype forget_gate = sigmoid(gates[2 * dim_ + i]);
+            insnet::dtype candidate = std::tanh(gates[3 * dim_ + i]);
+            cell[i] = forget_gate * cell[i] + input_gate * candidate;
+            hidden[i] = output_gate * std::tanh(cell[i]);
+        }
+    }
+
+    template <typename A, typename B>
+    static bool sameIds(const A &a, const B &b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (a[i] != b[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Word tables and caches are keyed by std::vector<int>, so a word held as a span is copied into
+    // a key kept by the thread, which has room for any word and so never reallocates.
+    static const std::vector<int> &wordKey(const std::vector<int> &word) {
+        return word;
+    }
+
+    static const std::vector<int> &wordKey(IdSpan word) {
+        thread_local std::vector<int> key;
+        key.reserve(MAX_WORD_LEN);
+        key.assign(word.begin(), word.end());
+        return key;
+    }
+
+    static void logSoftmax(std::pmr::vector<insnet::dtype> &vals) {
+        insnet::dtype max_val = *std::max_element(vals.begin(), vals.end());
+        insnet::dtype sum = 0;
+        for (insnet::dtype val : vals) {
+            sum += std::exp(val - max_val);
+        }
+        insnet::dtype log_sum = max_val + std::log(sum);
+        for (insnet::dtype &val : vals) {
+            val -= log_sum;
+        }
+    }
+
+    static constexpr insnet::dtype LAYER_NORM_EPS = 1e-6;
+
+    int dim_;
+    // Empty once quantized, when quantized_emb_ holds id i at [i * int8Stride(dim_), ...) and
+    // emb_scales_ its scale.
+    std::vector<insnet::dtype> emb_;
+    std::vector<int8_t> quantized_emb_;
+    std::vector<float> emb_scales_;
+    int vocab_size_;
+    Encoder word_enc_;
+    Encoder seg_enc_;
+    std::vector<Lstm> lstms_;
+    Linear output_;
+};
+
+// Runs the segments next_segment fills segment with until policy stops it or they run out, as
+// earlyExitSentEnc does, with the buffers and the log probs it returns taken from resource.
+template <typename SegmentT, typename NextSegment>
+std::pmr::vector<insnet::dtype> earlyExitSegmentEnc(SegmentT &segment,
+        const NextSegment &next_segment,
+        int seg_symbol_id,
+        const StaticEngine &engine,
+        const EarlyExitPolicy &policy,
+        int &seg_num,
+        const WordEncSources &word_enc_sources,
+        std::pmr::memory_resource *resource) {
+    StaticEngine::Workspace ws(engine, resource);
+    StaticEngine::State state = engine.initialState(resource);
+    std::pmr::vector<insnet::dtype> log_prob(resource);
+    int char_num = 0;
+    for (seg_num = 0; next_segment(segment);) {
+        engine.segmentEnc(segment, seg_symbol_id, word_enc_sources, ws, state, log_prob);
+        char_num += charCount(segment);
+        if (policy.shouldStop(log_prob, ++seg_num, char_num)) {
+            break;
+        }
+    }
+    return log_prob;
+}
+
+// The engine's counterpart of earlyExitSentEnc, reading the same segments under the same policy.
+// Its buffers and the log probs it returns come from resource.
+inline std::pmr::vector<insnet::dtype> earlyExitSentEnc(
+        const std::function<bool(Segment &)> &next_segment,
+        int seg_symbol_id,
+        const StaticEngine &engine,
+        const EarlyExitPolicy &policy,
+        int &seg_num,
+        const WordEncSources &word_enc_sources = {},
+        std::pmr::memory_resource *resource = std::pmr::get_default_resource()) {
+    Segment segment;
+    return earlyExitSegmentEnc(segment, next_segment, seg_symbol_id, engine, policy, seg_num,
+            word_enc_sources, resource);
+}
+
+// Reads the segments of sent in place, so that once resource has room for a doc and the word cache
+// in word_enc_sources is warm or full, a doc makes no heap call.
+inline std::pmr::vector<insnet::dtype> earlyExitSentEnc(IdSpan sent, int seg_len,
+        int seg_symbol_id,
+        const StaticEngine &engine,
+        insnet::Vocab &vocab,
+        const EarlyExitPolicy &policy,
+        int &seg_num,
+        const WordEncSources &word_enc_sources = {},
+        std::pmr::memory_resource *resource = std::pmr::get_default_resource()) {
+    SegmentReader reader(sent, seg_len, vocab.from_string(WORD_SYMBOL));
+    SegmentView segment(resource);
+    segment.reserve(seg_len);
+    auto next_segment = [&](SegmentView &segment) {
+        return reader.next(segment);
+    };
+    return earlyExitSegmentEnc(segment, next_segment, seg_symbol_id, engine, policy, seg_num,
+            word_enc_sources, resource);
+}
+
+// An int8 model file holds the vocabs and a quantized engine, after the format version and the
+// fileHash of the model it was quantized from, which word tables built from that model carry.
+inline constexpr int QUANTIZED_MODEL_VERSION = 1;
+
+inline void saveQuantizedModel(const StaticEngine &engine, insnet::Vocab &vocab,
+        insnet::Vocab &class_vocab,
+        uint64_t model_hash,
+        const std::string &filename) {
+    std::ofstream os(filename.c_str(), std::ios::binary);
+    if (!os) {
+        std::cerr << fmt::format("save int8 model fail - filename:{}", filename) << std::endl;
+        abort();
+    }
+    cereal::BinaryOutputArchive ar(os);
+    ar(QUANTIZED_MODEL_VERSION, model_hash, class_vocab, vocab, engine);
+}
+
+inline void loadQuantizedModel(StaticEngine &engine, insnet::Vocab &vocab,
+        insnet::Vocab &class_vocab,
+        uint64_t &model_hash,
+        const std::string &filename,
+        std::ostream &log = std::cout) {
+    log << "loading int8 model..." << std::endl;
+    std::ifstream is(filename.c_str(), std::ios::binary);
+    if (!is) {
+        std::cerr << fmt::format("load int8 model fail - filename:{}", filename) << std::endl;
+        abort();
+    }
+    cereal::BinaryInputArchive ar(is);
+    int version;
+    ar(version);
+    if (version != QUANTIZED_MODEL_VERSION) {
+        std::cerr << fmt::format("int8 model version {} is not {} - filename:{}", version,
+                QUANTIZED_MODEL_VERSION, filename) << std::endl;
+        abort();
+    }
+    ar(model_hash, class_vocab, vocab, engine);
+    if (!engine.quantized()) {
+        std::cerr << fmt::format("int8 model is not quantized - filename:{}", filename) <<
+            std::endl;
+        abort();
+    }
+    log << "int8 model loaded" << std::endl;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#include "cxxopts.hpp"
+#include "insnet/insnet.h"
+#include <string>
+#include <vector>
+#include "data_manager.h"
+#include "dataset_cache.h"
+#include "def.h"
+#include "common.h"
+#include "model/params.h"
+
+using cxxopts::Options;
+using std::string;
+using std::cout;
+using std::endl;
+using std::vector;
+using insnet::Vocab;
+
+// Tokenizes the training and dev sets once and writes them as dataset caches for main to map.
+int main(int argc, const char *argv[]) {
+    Options options("preprocess");
+    options.add_options()
+        ("model", "take the vocabs from this model instead of the training set",
+         cxxopts::value<string>()->default_value(""))
+        ("train", "training set dir", cxxopts::value<string>())
+        ("dev", "dev set dir", cxxopts::value<string>()->default_value(""))
+        ("train_cache", "where to write the training set cache",
+         cxxopts::value<string>()->default_value("train.cache"))
+        ("dev_cache", "where to write the dev set cache",
+         cxxopts::value<string>()->default_value("dev.cache"))
+        ("ratio", "dataset ratio", cxxopts::value<float>()->default_value("1"))
+        ("cutoff", "cutoff", cxxopts::value<int>()->default_value("0"))
+        ("threads", "corpus loading threads", cxxopts::value<int>()->default_value("1"));
+
+    auto args = options.parse(argc, argv);
+    float ratio = args["ratio"].as<float>();
+    int cutoff = args["cutoff"].as<int>();
+    int thread_num = args["threads"].as<int>();
+
+    ScannedCorpus train_corpus = scanCorpus(args["train"].as<string>(), cutoff, ratio,
+            thread_num);
+    Vocab vocab;
+    Vocab class_vocab;
+    string model_file = args["model"].as<string>();
+    if (model_file.empty()) {
+        vocab.init(train_corpus.char_list);
+        class_vocab.init(train_corpus.class_list);
+    } else {
+        ModelParams params;
+        loadModel(params, vocab, class_vocab, model_file);
+    }
+    cout << "vocab size:" << vocab.size() << endl;
+    cout << "class size:" << class_vocab.size() << endl;
+
+    // The lists are stored in id order, so that Vocab::init on them gives back the same ids.
+    vector<string> char_list = vocabList(vocab);
+    vector<string> class_list = vocabList(class_vocab);
+    CharVocab char_vocab(vocab.m_string_to_id);
+    int id_width = idWidthFor(vocab.size());
+    cout << "id width:" << id_width << endl;
+
+    auto train_set = remapCorpus(train_corpus, char_vocab, class_vocab.m_string_to_id, id_width);
+    string train_cache = args["train_cache"].as<string>();
+    writeDatasetCache(train_cache, char_list, class_list, cutoff, ratio, train_set);
+    cout << fmt::format("{} sents written to {}", train_set.size(), train_cache) << endl;
+
+    string dev_dir = args["dev"].as<string>();
+    if (!dev_dir.empty()) {
+        auto dev_set = readDataset(dev_dir, char_vocab, class_vocab.m_string_to_id, ratio,
+                thread_num, id_width);
+        string dev_cache = args["dev_cache"].as<string>();
+        writeDatasetCache(dev_cache, char_list, class_list, cutoff, ratio, dev_set);
+        cout << fmt::format("{} sents written to {}", dev_set.size(), dev_cache) << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "cxxopts.hpp"
+#include "insnet/insnet.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include "data_manager.h"
+#include "def.h"
+#include "common.h"
+#include "worker_pool.h"
+#include "word_table.h"
+#include "model/params.h"
+#include "model/model.h"
+#include "model/static_engine.h"
+
+using cxxopts::Options;
+using std::string;
+using std::cout;
+using std::endl;
+using std::vector;
+using std::move;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using insnet::dtype;
+using insnet::Vocab;
+
+// The class of the highest log prob, or -1 if the document had no segment to run. LogProb is a
+// vector of dtype with any allocator.
+template <typename LogProb>
+int predictedClass(const LogProb &log_prob) {
+    if (log_prob.empty()) {
+        return -1;
+    }
+    return std::max_element(log_prob.begin(), log_prob.end()) - log_prob.begin();
+}
+
+// The macro F1 of predicted over dataset, scored as evaluate scores.
+float macroF1(const vector<int> &predicted, const Dataset &dataset, int class_num) {
+    ClassScores scores(class_num);
+    for (int i = 0; i < predicted.size(); ++i) {
+        scores.add(predicted.at(i), dataset.classId(i));
+    }
+    return scores.macroF1();
+}
+
+// Quantizes a model to int8 for the static engine and writes it for what_lang's --int8_model.
+// Given a dev set, it reports the macro F1 of the int8 engine against that of the fp32 model,
+// both reading every segment of every document as evaluate does, and the time per doc of the
+// fp32 graphs, the fp32 engine and the int8 engine.
+int main(int argc, const char *argv[]) {
+    Options options("quantize");
+    options.add_options()
+        ("model", "load model", cxxopts::value<string>()->default_value("./model"))
+        ("output", "where to write the int8 model",
+         cxxopts::value<string>()->default_value("model.int8"))
+        ("dev", "dev set dir to compare the int8 model with the fp32 one on",
+         cxxopts::value<string>()->default_value(""))
+        ("ratio", "ratio of the dev set lines to read", cxxopts::value<float>()->default_value("1"))
+        ("seg_len", "segment length", cxxopts::value<int>()->default_value("64"))
+        ("threads", "number of worker threads", cxxopts::value<int>()->default_value("1"));
+
+    auto args = options.parse(argc, argv);
+    int thread_num = args["threads"].as<int>();
+
+    ModelParams params;
+    Vocab vocab, class_vocab;
+    string model_file = args["model"].as<string>();
+    loadModel(params, vocab, class_vocab, model_file);
+
+    StaticEngine fp32_engine(params);
+    StaticEngine engine(params);
+    engine.quantize();
+    cout << fmt::format("weights quantized from {} to {} bytes", fp32_engine.weightBytes(),
+            engine.weightBytes()) << endl;
+    string output = args["output"].as<string>();
+    saveQuantizedModel(engine, vocab, class_vocab, fileHash(model_file), output);
+    cout << fmt::format("int8 model written to {}", output) << endl;
+
+    string dev_dir = args["dev"].as<string>();
+    if (dev_dir.empty()) {
+        return 0;
+    }
+    CharVocab char_vocab(vocab.m_string_to_id);
+    Dataset dev_set = readDataset(dev_dir, char_vocab, class_vocab.m_string_to_id,
+            args["ratio"].as<float>(), thread_num, idWidthFor(vocab.size()));
+    cout << "dev set size:" << dev_set.size() << endl;
+
+    int seg_len = args["seg_len"].as<int>();
+    int seg_symbol_id = vocab.from_string(SEG_SYMBOL);
+    EarlyExitPolicy read_all;
+    read_all.prob_threshold = 2;
+    read_all.margin = 2;
+    read_all.max_seg_num = std::numeric_limits<int>::max();
+
+    // Each model runs over the whole dev set by itself, so that it is timed alone.
+    auto predict = [&](const string &name, const std::function<int(IdSpan)> &classify) {
+        vector<int> predicted(dev_set.size());
+        auto begin = steady_clock::now();
+        parallelFor(dev_set.size(), thread_num, [&](int i) {
+            predicted.at(i) = classify(dev_set.sent(i));
+        });
+        duration<double, std::milli> elapsed = steady_clock::now() - begin;
+        double ms_per_doc = elapsed.count() / std::max<size_t>(dev_set.size(), 1);
+        cout << fmt::format("{} ms per doc:{:.3f}", name, ms_per_doc) << endl;
+        return std::make_pair(move(predicted), ms_per_doc);
+    };
+    auto graph_run = predict("fp32 graphs", [&](IdSpan sent) {
+        int seg_num;
+        return predictedClass(earlyExitSentEnc(sent, seg_len, seg_symbol_id, params, read_all,
+                    seg_num));
+    });
+    auto fp32_engine_run = predict("fp32 engine", [&](IdSpan sent) {
+        int seg_num;
+        return predictedClass(earlyExitSentEnc(sent, seg_len, seg_symbol_id, fp32_engine, vocab,
+                    read_all, seg_num));
+    });
+    auto int8_run = predict("int8 engine", [&](IdSpan sent) {
+        int seg_num;
+        return predictedClass(earlyExitSentEnc(sent, seg_len, seg_symbol_id, engine, vocab,
+                    read_all, seg_num));
+    });
+    const vector<int> &fp32_predicted = graph_run.first;
+    const vector<int> &int8_predicted = int8_run.first;
+    cout << fmt::format("int8 engine speedup over fp32 engine:{:.2f} over fp32 graphs:{:.2f}",
+            fp32_engine_run.second / int8_run.second, graph_run.second / int8_run.second) << endl;
+
+    int agreed_num = 0;
+    for (int i = 0; i < dev_set.size(); ++i) {
+        agreed_num += fp32_predicted.at(i) == int8_predicted.at(i);
+    }
+    float fp32_f1 = macroF1(fp32_predicted, dev_set, class_vocab.size());
+    float int8_f1 = macroF1(int8_predicted, dev_set, class_vocab.size());
+    cout << fmt::format("fp32 macro f1:{} int8 macro f1:{} delta:{}", fp32_f1, int8_f1,
+            int8_f1 - fp32_f1) << endl;
+    cout << fmt::format("predictions agreed on {} of {} docs", agreed_num, dev_set.size()) <<
+        endl;
+
+    return 0;
+}
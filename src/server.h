@@ -0,0 +1,184 @@
+#ifndef LANG_ID_SERVER_H
+#define LANG_ID_SERVER_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fmt/core.h"
+#include "blocking_queue.h"
+
+inline int listenUnixSocket(const std::string &path) {
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << fmt::format("socket path too long:{}", path) << std::endl;
+        abort();
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+        std::cerr << fmt::format("listen on {} fail:{}", path, std::strerror(errno)) << std::endl;
+        abort();
+    }
+    return fd;
+}
+
+inline int listenLocalhost(int port) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+            bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+        std::cerr << fmt::format("listen on port {} fail:{}", port, std::strerror(errno))
+            << std::endl;
+        abort();
+    }
+    return fd;
+}
+
+inline bool writeAll(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+// Limits that keep one client from holding the server: a connection is closed once more than this
+// many bytes of a request have come without its newline, or after this long without a request or
+// with a response it does not read, and connections past this many are turned away.
+inline constexpr size_t MAX_REQUEST_BYTES = 4 << 20;
+inline constexpr int IDLE_TIMEOUT_SECONDS = 300;
+inline constexpr int MAX_CONNECTION_NUM = 1024;
+
+using ServerTask = std::packaged_task<std::string()>;
+
+// Reads newline-delimited requests from the connection until the peer closes it, and writes back
+// what handler returns for each of them, in order. The handler calls of the requests that arrive
+// together are pushed to tasks to run on the inference threads.
+inline void serveConnection(int fd, BlockingQueue<ServerTask> &tasks,
+        const std::function<std::string(const std::string &)> &handler) {
+    timeval timeout = {IDLE_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::vector<std::string> requests;
+    auto respond = [&]() {
+        std::vector<std::future<std::string>> responses;
+        responses.reserve(requests.size());
+        for (std::string &request : requests) {
+            ServerTask task([&handler, request = std::move(request)]() {
+                return handler(request);
+            });
+            responses.push_back(task.get_future());
+            tasks.push(std::move(task));
+        }
+        requests.clear();
+        std::string response;
+        for (std::future<std::string> &r : responses) {
+            response += r.get();
+        }
+        return response.empty() || writeAll(fd, response);
+    };
+
+    std::string pending;
+    char buf[1 << 16];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // n < 0 also when the connection has been idle for IDLE_TIMEOUT_SECONDS.
+            if (n == 0 && !pending.empty()) {
+                requests.push_back(std::move(pending));
+                respond();
+            }
+            break;
+        }
+        pending.append(buf, n);
+
+        size_t line_begin = 0;
+        for (size_t pos; (pos = pending.find('\n', line_begin)) != std::string::npos;
+                line_begin = pos + 1) {
+            size_t line_end = pos > line_begin && pending.at(pos - 1) == '\r' ? pos - 1 : pos;
+            requests.push_back(pending.substr(line_begin, line_end - line_begin));
+        }
+        pending.erase(0, line_begin);
+        if (!respond()) {
+            break;
+        }
+        if (pending.size() > MAX_REQUEST_BYTES) {
+            writeAll(fd, fmt::format("error: request longer than {} bytes\n", MAX_REQUEST_BYTES));
+            break;
+        }
+    }
+    close(fd);
+}
+
+// Runs handler on thread_num threads for every connection, each of which is read and written on
+// a thread of its own, so that an idle connection holds no inference thread. Never returns. The
+// handler must be safe to call concurrently.
+inline void serve(int listen_fd, int thread_num,
+        const std::function<std::string(const std::string &)> &handler) {
+    BlockingQueue<ServerTask> tasks(2 * thread_num + 2);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num; ++i) {
+        threads.emplace_back([&]() {
+            ServerTask task;
+            while (tasks.pop(task)) {
+                task();
+            }
+        });
+    }
+
+    std::atomic<int> connection_num(0);
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                std::cerr << fmt::format("accept fail:{}", std::strerror(errno)) << std::endl;
+            }
+            continue;
+        }
+        if (connection_num >= MAX_CONNECTION_NUM) {
+            writeAll(fd, fmt::format("error: more than {} connections\n", MAX_CONNECTION_NUM));
+            close(fd);
+            continue;
+        }
+        ++connection_num;
+        std::thread([&, fd]() {
+            serveConnection(fd, tasks, handler);
+            --connection_num;
+        }).detach();
+    }
+}
+
+#endif
@@ -16,12 +16,23 @@
 #include <mutex>
 #include <atomic>
 #include <queue>
+#include <map>
+#include <cstdint>
+#include <thread>
+#include "arena.h"
 #include "conversation_structure.h"
 #include "data_manager.h"
 #include "def.h"
 #include "common.h"
 #include "model/params.h"
 #include "model/model.h"
+#include "model/static_engine.h"
+#include "word_enc_cache.h"
+#include "word_table.h"
+#include "blocking_queue.h"
+#include "json_util.h"
+#include "server.h"
+#include "worker_pool.h"
 #include <iomanip>
 
 using cxxopts::Options;
@@ -56,22 +67,20 @@ using insnet::Profiler;
 
 inline std::pair<std::vector<std::vector<int>>, std::vector<std::string>> readDataset(
         const std::string &dir_name,
-        const std::unordered_map<std::string, int> &vocab) {
+        const CharVocab &vocab,
+        int verbose = 0) {
     std::vector<std::vector<int>> sent_ret;
     std::vector<std::string> file_name_ret;
+    std::string merged_content;
 
     for (const auto &entry : std::filesystem::directory_iterator(dir_name)) {
         std::string path = entry.path();
         file_name_ret.push_back(path);
-        std::ifstream ifs(path);
-        std::string raw_line;
-        std::string merged_content;
-        while (std::getline(ifs, raw_line)) {
-            merged_content += raw_line + " ";
+        readJoinedLines(path, merged_content);
+        if (verbose > 0) {
+            cout << merged_content << '\n';
         }
-        cout << merged_content << endl;
-        utf8_string line(merged_content);
-        auto words = splitIntoWords(line, vocab);
+        auto words = splitIntoWords(merged_content, vocab);
 
         sent_ret.push_back(move(words));
     }
@@ -79,34 +88,601 @@ inline std::pair<std::vector<std::vector<int>>, std::vector<std::string>> readDa
     return std::make_pair(sent_ret, file_name_ret);
 }
 
+struct Prediction {
+    int class_id;
+    dtype prob;
+    // The number of segments read before early exit stopped.
+    int seg_num;
+};
+
+// LogProb is a vector of dtype with any allocator.
+template <typename LogProb>
+Prediction predict(const LogProb &log_prob, int seg_num) {
+    int class_id = std::max_element(log_prob.begin(), log_prob.end()) - log_prob.begin();
+    return {class_id, std::exp(log_prob.at(class_id)), seg_num};
+}
+
+// The arena a worker thread runs the engine in, reset after every doc.
+Arena &workerArena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+// Calls run(resource, seg_num), which runs the engine from resource and returns the log probs it
+// allocated there, on the worker arena. The prediction is read before the arena is reset.
+template <typename Run>
+Prediction predictInArena(const Run &run) {
+    Arena &arena = workerArena();
+    Prediction ret;
+    {
+        int seg_num;
+        std::pmr::vector<dtype> log_prob = run(&arena, seg_num);
+        ret = log_prob.empty() ? Prediction{-1, 0, 0} : predict(log_prob, seg_num);
+    }
+    arena.reset();
+    return ret;
+}
+
+// Runs the model through engine if one is given and through graphs otherwise.
+Prediction classify(const vector<int> &ids, ModelParams &params, Vocab &vocab,
+        const EarlyExitPolicy &policy,
+        const WordEncSources &word_enc_sources,
+        const StaticEngine *engine) {
+    int seg_id = vocab.from_string(SEG_SYMBOL);
+    if (engine != nullptr) {
+        return predictInArena([&](std::pmr::memory_resource *resource, int &seg_num) {
+            return earlyExitSentEnc(ids, 64, seg_id, *engine, vocab, policy, seg_num,
+                    word_enc_sources, resource);
+        });
+    }
+    int seg_num;
+    vector<dtype> log_prob = earlyExitSentEnc(ids, 64, seg_id, params, policy, seg_num,
+            word_enc_sources);
+    return log_prob.empty() ? Prediction{-1, 0, 0} : predict(log_prob, seg_num);
+}
+
+// Reads and tokenizes the file at path only as far as policy needs to classify it.
+Prediction classifyLazily(const string &path, ModelParams &params, Vocab &vocab,
+        const CharVocab &char_vocab,
+        const EarlyExitPolicy &policy,
+        const WordEncSources &word_enc_sources,
+        const StaticEngine *engine) {
+    DocumentTokenizer doc(path, char_vocab);
+    Segmenter segmenter(64, vocab);
+    bool finished = false;
+    vector<int> ids;
+    auto next_segment = [&](Segment &segment) {
+        while (segmenter.segments().empty()) {
+            if (doc.next(ids)) {
+                for (int id : ids) {
+                    segmenter.push(id);
+                }
+            } else if (!finished) {
+                segmenter.finish();
+                finished = true;
+            } else {
+                return false;
+            }
+        }
+        segment = move(segmenter.segments().front());
+        segmenter.segments().pop_front();
+        return true;
+    };
+
+    int seg_id = vocab.from_string(SEG_SYMBOL);
+    if (engine != nullptr) {
+        return predictInArena([&](std::pmr::memory_resource *resource, int &seg_num) {
+            return earlyExitSentEnc(next_segment, seg_id, *engine, policy, seg_num,
+                    word_enc_sources, resource);
+        });
+    }
+    int seg_num;
+    vector<dtype> log_prob = earlyExitSentEnc(next_segment, seg_id, params, policy, seg_num,
+            word_enc_sources);
+    return log_prob.empty() ? Prediction{-1, 0, 0} : predict(log_prob, seg_num);
+}
+
+// Classifies docs [begin, end), packing no more than max_batch_seg_num segments into each graph.
+// Docs are cut where policy's budgets run out and the prediction is read at the segment where
+// policy stops, so results match classify one doc at a time. With an engine there is no graph to
+// fill, so docs are run one at a time.
+void classify(const vector<vector<int>> &docs, int begin, int end, int max_batch_seg_num,
+        ModelParams &params,
+        Vocab &vocab,
+        Vocab &class_vocab,
+        const EarlyExitPolicy &policy,
+        const WordEncSources &word_enc_sources,
+        const StaticEngine *engine,
+        vector<Prediction> &predictions) {
+    if (engine != nullptr) {
+        for (int i = begin; i < end; ++i) {
+            predictions.at(i) = classify(docs.at(i), params, vocab, policy, word_enc_sources,
+                    engine);
+        }
+        return;
+    }
+
+    int class_num = class_vocab.size();
+    int seg_id = vocab.from_string(SEG_SYMBOL);
+
+    for (int batch_begin = begin; batch_begin < end;) {
+        insnet::Graph graph(insnet::ModelStage::INFERENCE);
+        vector<insnet::LSTMState> states;
+        Node *zero = insnet::tensor(graph, params.word_enc.hiddenDim(), 0.0f);
+        for (int i = 0; i < params.sent_enc.size(); ++i) {
+            states.push_back({zero, zero});
+        }
+
+        vector<int> doc_ids;
+        vector<vector<Segment>> doc_segments;
+        vector<Node *> log_probs;
+        WordEncDedup dedup(word_enc_sources);
+        int seg_sum = 0;
+        int i = batch_begin;
+        for (; i < end && seg_sum < max_batch_seg_num; ++i) {
+            auto segments = splitIntoSegments(docs.at(i), 64, params.emb.vocab,
+                    policy.max_seg_num);
+            if (segments.empty()) {
+                predictions.at(i) = {-1, 0, 0};
+                continue;
+            }
+            policy.truncate(segments);
+            log_probs.push_back(sentEnc(segments, seg_id, graph, params, 0.1, states, &dedup));
+            seg_sum += segments.size();
+            doc_ids.push_back(i);
+            doc_segments.push_back(move(segments));
+        }
+        batch_begin = i;
+
+        graph.forward();
+        dedup.storeEncodings();
+        for (int j = 0; j < doc_ids.size(); ++j) {
+            vector<dtype> log_prob_vals = nodeValues(*log_probs.at(j));
+            const vector<Segment> &segments = doc_segments.at(j);
+            vector<dtype> log_prob;
+            int char_num = 0;
+            int seg_i = 0;
+            while (seg_i < segments.size()) {
+                auto seg_begin = log_prob_vals.begin() + seg_i * class_num;
+                log_prob.assign(seg_begin, seg_begin + class_num);
+                char_num += charCount(segments.at(seg_i++));
+                if (policy.shouldStop(log_prob, seg_i, char_num)) {
+                    break;
+                }
+            }
+            predictions.at(doc_ids.at(j)) = predict(log_prob, seg_i);
+        }
+    }
+}
+
+// Splits docs into batches of batch_size and classifies them on thread_num threads, each building
+// its own graphs against the shared params.
+vector<Prediction> classify(const vector<vector<int>> &docs, int batch_size,
+        int max_batch_seg_num,
+        int thread_num,
+        ModelParams &params,
+        Vocab &vocab,
+        Vocab &class_vocab,
+        const EarlyExitPolicy &policy,
+        const WordEncSources &word_enc_sources,
+        const StaticEngine *engine) {
+    vector<Prediction> ret(docs.size());
+    int batch_num = (docs.size() + batch_size - 1) / batch_size;
+    parallelFor(batch_num, thread_num, [&](int batch_i) {
+        int begin = batch_i * batch_size;
+        int end = std::min<int>(begin + batch_size, docs.size());
+        classify(docs, begin, end, max_batch_seg_num, params, vocab, class_vocab, policy,
+                word_enc_sources, engine, ret);
+    });
+    return ret;
+}
+
+struct StreamChunk {
+    int64_t seq;
+    vector<string> texts;
+    // Whether each record could be parsed.
+    vector<bool> valid;
+    vector<vector<int>> docs;
+    vector<Prediction> predictions;
+};
+
+string formatRecord(const Prediction &prediction, bool valid, bool jsonl, Vocab &class_vocab) {
+    string class_name = prediction.class_id < 0 ? UNK : class_vocab.from_id(prediction.class_id);
+    if (!jsonl) {
+        return fmt::format("{}\t{}\t{}\n", class_name, prediction.prob, prediction.seg_num);
+    } else if (!valid) {
+        return "{\"error\":\"invalid record\"}\n";
+    } else {
+        return fmt::format("{{\"class\":\"{}\",\"prob\":{},\"segments\":{}}}\n",
+                escapeJson(class_name), prediction.prob, prediction.seg_num);
+    }
+}
+
+// Classifies newline-delimited records from in and writes one result line per record to out, in
+// input order. Reading, tokenizing, inference on thread_num threads and writing run as separate
+// pipeline stages connected by bounded queues, so that I/O overlaps with the model.
+void classifyStream(std::istream &in, std::ostream &out, bool jsonl, const string &json_field,
+        int batch_size,
+        int max_batch_seg_num,
+        int thread_num,
+        ModelParams &params,
+        Vocab &vocab,
+        Vocab &class_vocab,
+        const CharVocab &char_vocab,
+        const EarlyExitPolicy &policy,
+        const WordEncSources &word_enc_sources,
+        const StaticEngine *engine) {
+    int queue_capacity = 2 * thread_num + 2;
+    BlockingQueue<StreamChunk> read_queue(queue_capacity);
+    BlockingQueue<StreamChunk> tokenized_queue(queue_capacity);
+    BlockingQueue<StreamChunk> classified_queue(queue_capacity);
+    // Holds the seq of every chunk read but not yet written, so that the reader stops once
+    // queue_capacity chunks are in flight and a stalled chunk cannot make the writer hold all the
+    // others that finish after it.
+    BlockingQueue<int64_t> in_flight(queue_capacity);
+
+    std::thread reader([&]() {
+        StreamChunk chunk;
+        chunk.seq = 0;
+        string line;
+        while (std::getline(in, line)) {
+            // Records are split as the server splits them, so CRLF input reads the same.
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            chunk.texts.push_back(move(line));
+            if (chunk.texts.size() == batch_size) {
+                int64_t seq = chunk.seq;
+                in_flight.push(seq);
+                read_queue.push(move(chunk));
+                chunk = StreamChunk();
+                chunk.seq = seq + 1;
+            }
+        }
+        if (!chunk.texts.empty()) {
+            in_flight.push(chunk.seq);
+            read_queue.push(move(chunk));
+        }
+        read_queue.close();
+    });
+
+    std::thread tokenizer([&]() {
+        StreamChunk chunk;
+        string text;
+        while (read_queue.pop(chunk)) {
+            for (const string &record : chunk.texts) {
+                bool valid = !jsonl || jsonStringField(record, json_field, text);
+                chunk.valid.push_back(valid);
+                chunk.docs.push_back(valid ? splitIntoWords(jsonl ? text : record, char_vocab) :
+                        vector<int>());
+            }
+            tokenized_queue.push(move(chunk));
+        }
+        tokenized_queue.close();
+    });
+
+    vector<std::thread> workers;
+    std::atomic<int> running_worker_num(thread_num);
+    for (int i = 0; i < thread_num; ++i) {
+        workers.emplace_back([&]() {
+            StreamChunk chunk;
+            while (tokenized_queue.pop(chunk)) {
+                chunk.predictions.resize(chunk.docs.size());
+                classify(chunk.docs, 0, chunk.docs.size(), max_batch_seg_num, params, vocab,
+                        class_vocab, policy, word_enc_sources, engine, chunk.predictions);
+                classified_queue.push(move(chunk));
+            }
+            if (--running_worker_num == 0) {
+                classified_queue.close();
+            }
+        });
+    }
+
+    // Workers finish chunks out of order, so early ones wait here for their turn.
+    std::map<int64_t, StreamChunk> pending;
+    int64_t next_seq = 0;
+    StreamChunk chunk;
+    string buffer;
+    while (classified_queue.pop(chunk)) {
+        pending.insert(make_pair(chunk.seq, move(chunk)));
+        for (auto it = pending.begin(); it != pending.end() && it->first == next_seq;
+                it = pending.erase(it), ++next_seq) {
+            const StreamChunk &ready = it->second;
+            buffer.clear();
+            for (int i = 0; i < ready.predictions.size(); ++i) {
+                buffer += formatRecord(ready.predictions.at(i), ready.valid.at(i), jsonl,
+                        class_vocab);
+            }
+            out.write(buffer.data(), buffer.size());
+            int64_t written_seq;
+            in_flight.pop(written_seq);
+        }
+        out.flush();
+    }
+
+    reader.join();
+    tokenizer.join();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// Runs every doc through graphs and through engine and reports how far apart their log probs end
+// up. Returns the number of docs the two classify differently.
+int verifyEngine(const vector<vector<int>> &docs, const vector<string> &paths,
+        ModelParams &params,
+        Vocab &vocab,
+        const StaticEngine &engine,
+        const EarlyExitPolicy &policy,
+        int thread_num) {
+    int seg_id = vocab.from_string(SEG_SYMBOL);
+    vector<dtype> max_diffs(docs.size(), 0);
+    vector<bool> disagreements(docs.size(), false);
+    parallelFor(docs.size(), thread_num, [&](int i) {
+        int graph_seg_num, engine_seg_num;
+        vector<dtype> graph_log_prob = earlyExitSentEnc(docs.at(i), 64, seg_id, params, policy,
+                graph_seg_num);
+        std::pmr::vector<dtype> engine_log_prob = earlyExitSentEnc(docs.at(i), 64, seg_id, engine,
+                vocab, policy, engine_seg_num);
+        if (graph_log_prob.empty() || engine_log_prob.empty()) {
+            disagreements.at(i) = graph_log_prob.size() != engine_log_prob.size();
+            return;
+        }
+        for (int j = 0; j < graph_log_prob.size(); ++j) {
+            max_diffs.at(i) = std::max<dtype>(max_diffs.at(i),
+                    std::abs(graph_log_prob.at(j) - engine_log_prob.at(j)));
+        }
+        disagreements.at(i) = graph_seg_num != engine_seg_num ||
+            predict(graph_log_prob, graph_seg_num).class_id !=
+            predict(engine_log_prob, engine_seg_num).class_id;
+    });
+
+    int disagreement_num = 0;
+    dtype max_diff = 0;
+    for (int i = 0; i < docs.size(); ++i) {
+        if (disagreements.at(i)) {
+            ++disagreement_num;
+            cout << fmt::format("engine disagrees on {}", paths.at(i)) << endl;
+        }
+        max_diff = std::max(max_diff, max_diffs.at(i));
+    }
+    cout << fmt::format("engine max log prob diff:{} disagreements:{}/{}", max_diff,
+            disagreement_num, docs.size()) << endl;
+    return disagreement_num;
+}
+
+void logWordEncStats(const WordEncCache *cache) {
+    const WordEncStats &stats = wordEncStats();
+    cerr << fmt::format("word encoding dedup hits:{}/{} rate:{} word table hits:{}",
+            stats.hit_num.load(), stats.lookup_num.load(), stats.hitRate(),
+            stats.table_hit_num.load()) << endl;
+    if (cache != nullptr) {
+        cerr << fmt::format("word encoding cache hits:{} misses:{} evictions:{} size:{}",
+                cache->hitNum(), cache->missNum(), cache->evictionNum(), cache->size()) << endl;
+    }
+}
+
+// Reports how the worker arenas served the engine. Once they have grown to fit the largest doc,
+// overflow allocations stop increasing.
+void logArenaStats() {
+    const ArenaStats &stats = arenaStats();
+    cerr << fmt::format("engine arena docs:{} allocations:{} overflow allocations:{} grows:{}",
+            stats.request_num.load(), stats.alloc_num.load(), stats.overflow_alloc_num.load(),
+            stats.grow_num.load()) << endl;
+}
+
 int main(int argc, const char *argv[]) {
+    std::ios::sync_with_stdio(false);
     ModelParams params;
     Vocab vocab, class_vocab;
 
     Options options("lang_id");
     options.add_options()
         ("model", "load model", cxxopts::value<string>()->default_value("./model"))
-        ("corpus", "corpus dir", cxxopts::value<string>());
+        ("corpus", "corpus dir", cxxopts::value<string>())
+        ("serve", "keep the model loaded and answer each line with its class, prob and segments",
+         cxxopts::value<bool>()->default_value("false"))
+        ("socket", "unix socket path to serve on", cxxopts::value<string>()->default_value(""))
+        ("port", "localhost port to serve on if no socket is given",
+         cxxopts::value<int>()->default_value("8000"))
+        ("batch_size", "max number of docs classified in one graph",
+         cxxopts::value<int>()->default_value("32"))
+        ("max_batch_seg_num", "max number of segments in one graph",
+         cxxopts::value<int>()->default_value("512"))
+        ("threads", "number of worker threads", cxxopts::value<int>()->default_value("1"))
+        ("exit_prob", "stop reading a doc once the top class prob exceeds this",
+         cxxopts::value<float>()->default_value("0.9999"))
+        ("exit_margin", "stop reading a doc once the top class prob exceeds the second by this",
+         cxxopts::value<float>()->default_value("1"))
+        ("max_seg_num", "max number of segments read per doc",
+         cxxopts::value<int>()->default_value("65"))
+        ("max_char_num", "stop reading a doc after the segment reaching this many chars",
+         cxxopts::value<int>()->default_value(std::to_string(std::numeric_limits<int>::max())))
+        ("lazy", "read each doc only as far as early exit needs",
+         cxxopts::value<bool>()->default_value("false"))
+        ("stdin", "classify records read from stdin, one per line, and write results to stdout",
+         cxxopts::value<bool>()->default_value("false"))
+        ("jsonl", "read stdin records as JSON objects and write JSON results",
+         cxxopts::value<bool>()->default_value("false"))
+        ("json_field", "the field holding the text of a JSON record",
+         cxxopts::value<string>()->default_value("text"))
+        ("word_table", "read the encodings of the words in this table made by build_word_table",
+         cxxopts::value<string>()->default_value(""))
+        ("word_cache_size", "max number of word encodings kept across graphs and requests, 0 for "
+         "none", cxxopts::value<int>()->default_value("0"))
+        ("word_cache_shards", "number of independently locked parts of the word encoding cache",
+         cxxopts::value<int>()->default_value("16"))
+        ("static_engine", "run the model without building graphs",
+         cxxopts::value<bool>()->default_value("false"))
+        ("verify_engine", "classify the corpus dir both with graphs and without them, and report "
+         "where the two differ", cxxopts::value<bool>()->default_value("false"))
+        ("int8_model", "run the static engine on this model made by quantize, loading --model "
+         "only to verify against", cxxopts::value<string>()->default_value(""))
+        ("verbose", "1 to echo every doc read and report word encoding dedup and cache hits and "
+         "engine allocations to stderr",
+         cxxopts::value<int>()->default_value("0"));
 
     auto args = options.parse(argc, argv);
-    loadModel(params, vocab, class_vocab, args["model"].as<string>());
+    // In stdin mode stdout carries only the results.
+    bool streaming = args["stdin"].as<bool>();
+    string model_file = args["model"].as<string>();
+    string int8_model_file = args["int8_model"].as<string>();
+    bool verify_engine = args["verify_engine"].as<bool>();
+    if (verify_engine && (streaming || args["serve"].as<bool>() || args["lazy"].as<bool>())) {
+        cerr << "verify_engine checks a corpus dir read in full, not --stdin, --serve or --lazy"
+            << endl;
+        abort();
+    }
+    unique_ptr<StaticEngine> engine;
+    uint64_t model_hash = 0;
+    if (int8_model_file.empty() || verify_engine) {
+        loadModel(params, vocab, class_vocab, model_file, streaming ? cerr : cout);
+        model_hash = fileHash(model_file);
+    }
+    if (!int8_model_file.empty()) {
+        // Verified against --model, the int8 model must have been quantized from it, and the
+        // graphs keep the vocabs of --model.
+        Vocab int8_vocab, int8_class_vocab;
+        uint64_t int8_model_hash;
+        engine = make_unique<StaticEngine>();
+        loadQuantizedModel(*engine, int8_vocab, int8_class_vocab, int8_model_hash,
+                int8_model_file, streaming ? cerr : cout);
+        if (!verify_engine) {
+            vocab = move(int8_vocab);
+            class_vocab = move(int8_class_vocab);
+            model_hash = int8_model_hash;
+        } else if (int8_model_hash != model_hash) {
+            cerr << fmt::format("int8 model {} was not quantized from {}", int8_model_file,
+                    model_file) << endl;
+            abort();
+        }
+    } else if (args["static_engine"].as<bool>()) {
+        engine = make_unique<StaticEngine>(params);
+    }
+    int dim = engine != nullptr ? engine->dim() : params.word_enc.hiddenDim();
 
-    auto text_info = readDataset(args["corpus"].as<string>(), vocab.m_string_to_id);
+    unique_ptr<WordTable> word_table;
+    string word_table_file = args["word_table"].as<string>();
+    if (!word_table_file.empty()) {
+        word_table = make_unique<WordTable>(word_table_file);
+        if (word_table->modelHash() != model_hash || word_table->dim() != dim) {
+            cerr << fmt::format("word table {} was made with another model and is ignored",
+                    word_table_file) << endl;
+            word_table.reset();
+        } else {
+            cerr << fmt::format("word table size:{}", word_table->size()) << endl;
+        }
+    }
+    unique_ptr<WordEncCache> word_cache;
+    int word_cache_size = args["word_cache_size"].as<int>();
+    if (word_cache_size > 0) {
+        int word_cache_shards = args["word_cache_shards"].as<int>();
+        if (word_cache_shards < 1) {
+            cerr << fmt::format("word_cache_shards is {} but must be at least 1",
+                    word_cache_shards) << endl;
+            abort();
+        }
+        word_cache = make_unique<WordEncCache>(word_cache_size, word_cache_shards);
+    }
+    WordEncSources word_enc_sources = {word_table.get(), word_cache.get()};
+    auto log_stats = [&]() {
+        logWordEncStats(word_cache.get());
+        if (engine != nullptr) {
+            logArenaStats();
+        }
+    };
 
-    for (int i = 0; i < text_info.first.size(); ++i) {
-        insnet::Graph graph(insnet::ModelStage::INFERENCE);
-        Node *zero = insnet::tensor(graph, 512, 0.0f);
-        insnet::LSTMState state = {zero, zero};
-        vector<insnet::LSTMState> states = {state};
-        int seg_id = vocab.from_string(SEG_SYMBOL);
-        Node *log_prob = sentEnc(text_info.first.at(i), 64, seg_id, graph, params, 0.1, states,
-                true);
-        log_prob = insnet::split(*log_prob, class_vocab.size(),
-                log_prob->size() - class_vocab.size());
-        graph.forward();
-        int class_id = insnet::argmax({log_prob}, class_vocab.size()).front().back();
-        cout << fmt::format("filename:{} class:{} prob:{}", text_info.second.at(i),
-                class_vocab.from_id(class_id), std::exp(log_prob->getVal()[class_id])) << endl;
+    CharVocab char_vocab(vocab.m_string_to_id);
+    int thread_num = args["threads"].as<int>();
+    int verbose = args["verbose"].as<int>();
+    EarlyExitPolicy policy;
+    policy.prob_threshold = args["exit_prob"].as<float>();
+    policy.margin = args["exit_margin"].as<float>();
+    policy.max_seg_num = args["max_seg_num"].as<int>();
+    if (policy.max_seg_num < 1) {
+        cerr << fmt::format("max_seg_num is {} but must be at least 1", policy.max_seg_num) <<
+            endl;
+        abort();
+    }
+    policy.max_char_num = args["max_char_num"].as<int>();
+
+    if (args["serve"].as<bool>()) {
+        string socket_path = args["socket"].as<string>();
+        int listen_fd;
+        if (socket_path.empty()) {
+            int port = args["port"].as<int>();
+            listen_fd = listenLocalhost(port);
+            cout << fmt::format("serving on 127.0.0.1:{}", port) << endl;
+        } else {
+            listen_fd = listenUnixSocket(socket_path);
+            cout << fmt::format("serving on {}", socket_path) << endl;
+        }
+
+        // The server never returns, so with verbose on it reports its stats every so many requests.
+        constexpr int64_t STATS_INTERVAL = 10000;
+        std::atomic<int64_t> request_num(0);
+        serve(listen_fd, thread_num, [&](const string &text) {
+            auto ids = splitIntoWords(text, char_vocab);
+            Prediction prediction = classify(ids, params, vocab, policy, word_enc_sources,
+                    engine.get());
+            if (verbose > 0 && ++request_num % STATS_INTERVAL == 0) {
+                log_stats();
+            }
+            string class_name = prediction.class_id < 0 ? UNK :
+                class_vocab.from_id(prediction.class_id);
+            return fmt::format("{}\t{}\t{}\n", class_name, prediction.prob, prediction.seg_num);
+        });
+        return 0;
+    }
+
+    if (streaming) {
+        classifyStream(std::cin, cout, args["jsonl"].as<bool>(), args["json_field"].as<string>(),
+                args["batch_size"].as<int>(), args["max_batch_seg_num"].as<int>(), thread_num,
+                params, vocab, class_vocab, char_vocab, policy, word_enc_sources, engine.get());
+        if (verbose > 0) {
+            log_stats();
+        }
+        return 0;
+    }
+
+    vector<string> paths;
+    vector<Prediction> predictions;
+    if (args["lazy"].as<bool>()) {
+        for (const auto &entry : std::filesystem::directory_iterator(args["corpus"].as<string>())) {
+            paths.push_back(entry.path());
+        }
+        predictions.resize(paths.size());
+        parallelFor(paths.size(), thread_num, [&](int i) {
+            predictions.at(i) = classifyLazily(paths.at(i), params, vocab, char_vocab, policy,
+                    word_enc_sources, engine.get());
+        });
+    } else {
+        auto text_info = readDataset(args["corpus"].as<string>(), char_vocab, verbose);
+        paths = move(text_info.second);
+        if (verify_engine) {
+            // An int8 engine is verified as it is; otherwise one is made from the model.
+            unique_ptr<StaticEngine> fp32_engine;
+            if (engine == nullptr) {
+                fp32_engine = make_unique<StaticEngine>(params);
+            }
+            return verifyEngine(text_info.first, paths, params, vocab,
+                    engine != nullptr ? *engine : *fp32_engine, policy, thread_num) == 0 ? 0 : 1;
+        }
+        predictions = classify(text_info.first, args["batch_size"].as<int>(),
+                args["max_batch_seg_num"].as<int>(), thread_num, params, vocab, class_vocab,
+                policy, word_enc_sources, engine.get());
+    }
+
+    for (int i = 0; i < paths.size(); ++i) {
+        const Prediction &prediction = predictions.at(i);
+        string class_name = prediction.class_id < 0 ? UNK :
+            class_vocab.from_id(prediction.class_id);
+        cout << fmt::format("filename:{} class:{} prob:{} segments:{}\n", paths.at(i), class_name,
+                prediction.prob, prediction.seg_num);
+    }
+    cout.flush();
+    if (verbose > 0) {
+        log_stats();
     }
     return 0;
 }
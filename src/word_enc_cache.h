@@ -0,0 +1,142 @@
+#ifndef LANG_ID_WORD_ENC_CACHE_H
+#define LANG_ID_WORD_ENC_CACHE_H
+
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "insnet/insnet.h"
+#include "dataset.h"
+#include "def.h"
+
+// Word encodings kept across graphs and requests, bounded to capacity words and evicting the least
+// recently used one when full. The words are spread over shards by hash, each with its own lock
+// and LRU list, so that threads looking up different words rarely wait for each other.
+class WordEncCache {
+public:
+    WordEncCache(size_t capacity, int shard_num) : shards_(shard_num) {
+        size_t shard_capacity = (capacity + shard_num - 1) / shard_num;
+        for (Shard &shard : shards_) {
+            shard.capacity = shard_capacity;
+        }
+    }
+
+    WordEncCache(const WordEncCache &) = delete;
+    WordEncCache &operator=(const WordEncCache &) = delete;
+
+    // Copies the encoding of word into vals and marks it recently used, if it is cached.
+    bool find(const std::vector<int> &word, std::vector<insnet::dtype> &vals) {
+        return findWith(word, [&](const std::vector<insnet::dtype> &cached) {
+            vals = cached;
+        });
+    }
+
+    // The same, copying into the dim values at vals.
+    bool find(const std::vector<int> &word, insnet::dtype *vals) {
+        return findWith(word, [&](const std::vector<insnet::dtype> &cached) {
+            std::copy(cached.begin(), cached.end(), vals);
+        });
+    }
+
+    void insert(const std::vector<int> &word, const std::vector<insnet::dtype> &vals) {
+        insert(word, vals.data(), vals.size());
+    }
+
+    // The same, copying the size values at vals. Once the shard of word is full, the least recently
+    // used entry is evicted and its key, values and nodes are reused, so no heap call is made.
+    void insert(const std::vector<int> &word, const insnet::dtype *vals, size_t size) {
+        Shard &shard = shardOf(word);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.capacity == 0 || shard.entries.count(word) > 0) {
+            // Another thread encoded the same word in the meantime.
+            return;
+        }
+        if (shard.entries.size() == shard.capacity) {
+            auto node = shard.entries.extract(shard.lru.back().first);
+            shard.lru.splice(shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+            Entry &entry = shard.lru.front();
+            entry.first.assign(word.begin(), word.end());
+            entry.second.assign(vals, vals + size);
+            node.key().assign(word.begin(), word.end());
+            shard.entries.insert(std::move(node));
+            ++eviction_num_;
+            return;
+        }
+        // Keys have room for any word, so that the entry can be reused for any word once evicted.
+        auto key = [&]() {
+            std::vector<int> ret;
+            ret.reserve(MAX_WORD_LEN);
+            ret.assign(word.begin(), word.end());
+            return ret;
+        };
+        shard.lru.emplace_front(key(), std::vector<insnet::dtype>(vals, vals + size));
+        shard.entries.emplace(key(), shard.lru.begin());
+    }
+
+    int64_t hitNum() const {
+        return hit_num_;
+    }
+
+    int64_t missNum() const {
+        return miss_num_;
+    }
+
+    int64_t evictionNum() const {
+        return eviction_num_;
+    }
+
+    size_t size() const {
+        size_t ret = 0;
+        for (const Shard &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            ret += shard.entries.size();
+        }
+        return ret;
+    }
+
+private:
+    using Entry = std::pair<std::vector<int>, std::vector<insnet::dtype>>;
+
+    struct Shard {
+        mutable std::mutex mutex;
+        size_t capacity;
+        // Most recently used first.
+        std::list<Entry> lru;
+        std::unordered_map<std::vector<int>, std::list<Entry>::iterator, IdsHash> entries;
+    };
+
+    template <typename Copy>
+    bool findWith(const std::vector<int> &word, const Copy &copy) {
+        Shard &shard = shardOf(word);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(word);
+        if (it == shard.entries.end()) {
+            ++miss_num_;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        copy(it->second->second);
+        ++hit_num_;
+        return true;
+    }
+
+    Shard &shardOf(const std::vector<int> &word) {
+        // The maps inside a shard bucket by the low bits of the same hash, so the shard is picked
+        // by the high ones.
+        uint64_t hash = IdsHash()(word) * 0x9e3779b97f4a7c15ull;
+        return shards_[(hash >> 32) % shards_.size()];
+    }
+
+    std::vector<Shard> shards_;
+    std::atomic<int64_t> hit_num_ = 0;
+    std::atomic<int64_t> miss_num_ = 0;
+    std::atomic<int64_t> eviction_num_ = 0;
+};
+
+#endif
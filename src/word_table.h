@@ -0,0 +1,171 @@
+#ifndef LANG_ID_WORD_TABLE_H
+#define LANG_ID_WORD_TABLE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "fmt/core.h"
+#include "insnet/insnet.h"
+#include "dataset.h"
+#include "mapped_file.h"
+
+// Word encodings computed ahead of time by build_word_table, laid out so that the vectors can
+// be read straight from a memory mapping:
+//
+//   WordTableHeader
+//   every word as a uint32 length and that many int32 char ids
+//   zero padding up to a multiple of 8 bytes
+//   dtype vectors[word_num][dim], in the order of the words
+//
+// The encodings depend on every weight of the word encoder, so the header holds a hash of the
+// model file they were computed with rather than of its vocabulary.
+
+inline constexpr char WORD_TABLE_MAGIC[8] = {'L', 'I', 'D', 'W', 'O', 'R', 'D', 'T'};
+inline constexpr uint32_t WORD_TABLE_VERSION = 1;
+
+struct WordTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint64_t model_hash;
+    uint64_t word_num;
+    uint64_t word_bytes;
+};
+
+static_assert(sizeof(WordTableHeader) % 8 == 0, "the vectors after the header must stay aligned");
+
+// FNV-1a over 8-byte words of the file at path, with the tail bytes folded in one at a time.
+inline uint64_t fileHash(const std::string &path) {
+    MappedFile file(path);
+    std::string_view content = file.content();
+    uint64_t hash = 14695981039346656037ull ^ content.size();
+    size_t i = 0;
+    for (; i + 8 <= content.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, content.data() + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < content.size(); ++i) {
+        hash = (hash ^ static_cast<unsigned char>(content[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// words.at(i) is encoded as vectors[i * dim, (i + 1) * dim).
+inline void writeWordTable(const std::string &path, uint64_t model_hash, int dim,
+        const std::vector<std::vector<int>> &words,
+        const std::vector<insnet::dtype> &vectors) {
+    std::string word_bytes;
+    for (const std::vector<int> &word : words) {
+        uint32_t len = word.size();
+        word_bytes.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        word_bytes.append(reinterpret_cast<const char *>(word.data()), len * sizeof(int32_t));
+    }
+    word_bytes.resize((word_bytes.size() + 7) / 8 * 8, '\0');
+
+    WordTableHeader header = {};
+    std::memcpy(header.magic, WORD_TABLE_MAGIC, sizeof(header.magic));
+    header.version = WORD_TABLE_VERSION;
+    header.dim = dim;
+    header.model_hash = model_hash;
+    header.word_num = words.size();
+    header.word_bytes = word_bytes.size();
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(word_bytes.data(), word_bytes.size());
+    out.write(reinterpret_cast<const char *>(vectors.data()),
+            vectors.size() * sizeof(insnet::dtype));
+    if (!out) {
+        std::cerr << fmt::format("write {} fail", path) << std::endl;
+        abort();
+    }
+}
+
+// A word table mapped into memory. Only the words are decoded on open, into a hash map from a
+// word's char ids to its vector in the mapping.
+class WordTable {
+public:
+    // Lookups hit words all over the table, so the whole file is asked for up front.
+    explicit WordTable(const std::string &path) : file_(path, MADV_WILLNEED) {
+        std::string_view content = file_.content();
+        if (content.size() < sizeof(WordTableHeader) ||
+                std::memcmp(content.data(), WORD_TABLE_MAGIC, sizeof(WORD_TABLE_MAGIC))) {
+            std::cerr << fmt::format("{} is not a word table", path) << std::endl;
+            abort();
+        }
+        header_ = reinterpret_cast<const WordTableHeader *>(content.data());
+        if (header_->version != WORD_TABLE_VERSION) {
+            std::cerr << fmt::format("word table {} has version {} but {} is expected", path,
+                    header_->version, WORD_TABLE_VERSION) << std::endl;
+            abort();
+        }
+        size_t expected_size = sizeof(WordTableHeader) + header_->word_bytes +
+            header_->word_num * header_->dim * sizeof(insnet::dtype);
+        if (content.size() != expected_size) {
+            std::cerr << fmt::format("word table {} is truncated", path) << std::endl;
+            abort();
+        }
+
+        auto corrupt = [&]() {
+            std::cerr << fmt::format("word table {} is corrupt: the words overrun their bytes",
+                    path) << std::endl;
+            abort();
+        };
+        if (header_->word_num > header_->word_bytes / sizeof(uint32_t)) {
+            corrupt();
+        }
+
+        const char *words = content.data() + sizeof(WordTableHeader);
+        const insnet::dtype *vectors = reinterpret_cast<const insnet::dtype *>(words +
+                header_->word_bytes);
+        rows_.reserve(header_->word_num);
+        size_t pos = 0;
+        std::vector<int> word;
+        for (uint64_t i = 0; i < header_->word_num; ++i) {
+            uint32_t len;
+            if (header_->word_bytes - pos < sizeof(len)) {
+                corrupt();
+            }
+            std::memcpy(&len, words + pos, sizeof(len));
+            pos += sizeof(len);
+            if ((header_->word_bytes - pos) / sizeof(int32_t) < len) {
+                corrupt();
+            }
+            word.resize(len);
+            std::memcpy(word.data(), words + pos, len * sizeof(int32_t));
+            pos += len * sizeof(int32_t);
+            rows_.emplace(word, vectors + i * header_->dim);
+        }
+    }
+
+    uint64_t modelHash() const {
+        return header_->model_hash;
+    }
+
+    int dim() const {
+        return header_->dim;
+    }
+
+    size_t size() const {
+        return rows_.size();
+    }
+
+    // The dim() values encoding word, or nullptr if word is not in the table.
+    const insnet::dtype *find(const std::vector<int> &word) const {
+        auto it = rows_.find(word);
+        return it == rows_.end() ? nullptr : it->second;
+    }
+
+private:
+    MappedFile file_;
+    const WordTableHeader *header_;
+    std::unordered_map<std::vector<int>, const insnet::dtype *, IdsHash> rows_;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef LANG_ID_WORKER_POOL_H
+#define LANG_ID_WORKER_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Calls task(i) for every i in [0, task_num) from thread_num threads. Tasks are handed out in
+// index order through a shared counter, so callers keep input order by writing results at i.
+inline void parallelFor(int task_num, int thread_num, const std::function<void(int)> &task) {
+    thread_num = std::min(thread_num, task_num);
+    if (thread_num <= 1) {
+        for (int i = 0; i < task_num; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next_task(0);
+    std::vector<std::thread> threads;
+    threads.reserve(thread_num);
+    for (int i = 0; i < thread_num; ++i) {
+        threads.emplace_back([&]() {
+            for (int task_i; (task_i = next_task++) < task_num;) {
+                task(task_i);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+#endif